@@ -0,0 +1,451 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "xmalloc.h"
+#include "list.h"
+
+// Allocator stress patterns for comparing backends. Each run does a fixed
+// amount of work per thread and prints one CSV line:
+//
+//   backend,pattern,threads,ops,seconds,ops_per_sec,peak_rss_kb
+//
+// where an op is one xmalloc, xfree or xrealloc. `make bench` runs every
+// pattern for every backend at 1..BENCH_THREADS threads.
+//
+//   prodcons  each thread allocates and hands the blocks to the next
+//             thread, which frees them: every free is cross-thread
+//   larson    random-size churn over a per-thread slot array; every round
+//             the array passes to a new thread, which frees what the old
+//             one allocated (after Larson and Krishnan)
+//   random    sizes from 8 bytes to 64 KiB, skewed small, mixed with
+//             reallocs, over a per-thread slot array
+//   fixed     64-byte blocks allocated and freed in batches of 100
+//   lists     a 100-cell list built with cons, copied with copy_list and
+//             both freed with free_list, as the collatz tasks do
+//   arena     the same lists in an xarena_t, dropped with xarena_reset();
+//             each cell counts as an alloc and a free
+//   pool      the same lists with cells from one xpool_t shared by all
+//             threads
+
+#define SLOTS 1000
+#define RING 1024
+#define ROUNDS 10
+#define LIST_LEN 100
+
+typedef struct ring {
+	void* items[RING];
+	long head;            // next slot to write, producer only
+	long tail;            // next slot to read, consumer only
+} ring;
+
+typedef struct worker {
+	pthread_t thread;
+	long id;
+	long ops;             // ops to do, then ops done
+	uint64_t rng;
+	void** slots;
+	ring* in;
+	ring* out;
+} worker;
+
+static long nthreads = 1;
+static long ops_per_thread = 1000000;
+static xpool_t* cell_pool = NULL;
+
+static
+uint64_t
+next_rand(uint64_t* state)
+{
+	uint64_t xx = *state;
+	xx ^= xx << 13;
+	xx ^= xx >> 7;
+	xx ^= xx << 17;
+	*state = xx;
+	return xx;
+}
+
+// 8..4096 bytes, log-uniform, with one in 64 as large as 64 KiB.
+static
+size_t
+random_size(uint64_t* rng)
+{
+	uint64_t rr = next_rand(rng);
+
+	if (rr % 64 == 0)
+		return 4096 + (rr >> 8) % (60 * 1024);
+
+	long shift = 3 + (rr >> 6) % 10;
+	return ((size_t)1 << shift) + (rr >> 16) % ((size_t)1 << shift);
+}
+
+static
+void
+touch(void* ptr)
+{
+	*(char*)ptr = 1;
+}
+
+// Running out of memory mid-run would skew the numbers, so stop there.
+static
+void
+out_of_memory(const char* call, size_t bytes)
+{
+	fprintf(stderr, "bench: %s(%zu) failed\n", call, bytes);
+	abort();
+}
+
+static
+int
+ring_push(ring* rr, void* ptr)
+{
+	long head = rr->head;
+	if (head - __atomic_load_n(&rr->tail, __ATOMIC_ACQUIRE) == RING)
+		return 0;
+
+	rr->items[head % RING] = ptr;
+	__atomic_store_n(&rr->head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static
+void*
+ring_pop(ring* rr)
+{
+	long tail = rr->tail;
+	if (tail == __atomic_load_n(&rr->head, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	void* ptr = rr->items[tail % RING];
+	__atomic_store_n(&rr->tail, tail + 1, __ATOMIC_RELEASE);
+	return ptr;
+}
+
+// Allocations go out on one ring and frees come in on another. With one
+// thread the two rings are the same.
+static
+void*
+run_prodcons(void* arg)
+{
+	worker* ww = (worker*)arg;
+	long made = 0;
+	long freed = 0;
+	long todo = ww->ops / 2;
+
+	while (made < todo || freed < todo) {
+		if (made < todo) {
+			size_t size = 16 + next_rand(&ww->rng) % 240;
+			void* ptr = xmalloc(size);
+			if (!ptr)
+				out_of_memory("xmalloc", size);
+			touch(ptr);
+
+			while (!ring_push(ww->out, ptr)) {
+				void* tmp = ring_pop(ww->in);
+				if (tmp) {
+					xfree(tmp);
+					freed += 1;
+				}
+				else {
+					sched_yield();
+				}
+			}
+			made += 1;
+		}
+
+		void* tmp = ring_pop(ww->in);
+		if (tmp) {
+			xfree(tmp);
+			freed += 1;
+		}
+		else if (made == todo) {
+			sched_yield();
+		}
+	}
+
+	ww->ops = made + freed;
+	return NULL;
+}
+
+static
+void*
+run_larson(void* arg)
+{
+	worker* ww = (worker*)arg;
+	long round_ops = ww->ops / ROUNDS;
+	long done = 0;
+
+	for (long ii = 0; ii < round_ops; ii++) {
+		long kk = next_rand(&ww->rng) % SLOTS;
+
+		if (ww->slots[kk]) {
+			xfree(ww->slots[kk]);
+			done += 1;
+		}
+
+		size_t size = 16 + next_rand(&ww->rng) % 112;
+		if (!(ww->slots[kk] = xmalloc(size)))
+			out_of_memory("xmalloc", size);
+		touch(ww->slots[kk]);
+		done += 1;
+	}
+
+	ww->ops = done;
+	return NULL;
+}
+
+static
+void*
+run_random(void* arg)
+{
+	worker* ww = (worker*)arg;
+	long done = 0;
+
+	while (done < ww->ops) {
+		uint64_t rr = next_rand(&ww->rng);
+		void** slot = &ww->slots[rr % SLOTS];
+
+		if (!*slot) {
+			size_t size = random_size(&ww->rng);
+			if (!(*slot = xmalloc(size)))
+				out_of_memory("xmalloc", size);
+			touch(*slot);
+		}
+		else if ((rr >> 32) % 4 == 0) {
+			size_t size = random_size(&ww->rng);
+			void* tmp = xrealloc(*slot, size);
+			if (!tmp)
+				out_of_memory("xrealloc", size);
+			*slot = tmp;
+			touch(*slot);
+		}
+		else {
+			xfree(*slot);
+			*slot = NULL;
+		}
+		done += 1;
+	}
+
+	ww->ops = done;
+	return NULL;
+}
+
+static
+void*
+run_fixed(void* arg)
+{
+	worker* ww = (worker*)arg;
+	void* batch[100];
+	long done = 0;
+
+	while (done < ww->ops) {
+		for (long ii = 0; ii < 100; ii++) {
+			if (!(batch[ii] = xmalloc(64)))
+				out_of_memory("xmalloc", 64);
+			touch(batch[ii]);
+		}
+		for (long ii = 0; ii < 100; ii++)
+			xfree(batch[ii]);
+		done += 200;
+	}
+
+	ww->ops = done;
+	return NULL;
+}
+
+static
+void*
+run_lists(void* arg)
+{
+	worker* ww = (worker*)arg;
+	long done = 0;
+
+	while (done < ww->ops) {
+		cell* xs = 0;
+		for (long ii = 0; ii < LIST_LEN; ii++)
+			xs = cons(ii, xs);
+
+		cell* ys = copy_list(xs);
+		if (count_list(ys) != LIST_LEN)
+			abort();
+
+		free_list(xs);
+		free_list(ys);
+		done += 4 * LIST_LEN;
+	}
+
+	ww->ops = done;
+	return NULL;
+}
+
+static
+void*
+run_arena(void* arg)
+{
+	worker* ww = (worker*)arg;
+	xarena_t* ar = xarena_create();
+	long done = 0;
+
+	if (!ar)
+		out_of_memory("xarena_create", 0);
+
+	while (done < ww->ops) {
+		cell* xs = 0;
+		for (long ii = 0; ii < LIST_LEN; ii++)
+			xs = arena_cons(ar, ii, xs);
+
+		cell* ys = arena_copy_list(ar, xs);
+		if (count_list(ys) != LIST_LEN)
+			abort();
+
+		xarena_reset(ar);
+		done += 4 * LIST_LEN;
+	}
+
+	xarena_destroy(ar);
+	ww->ops = done;
+	return NULL;
+}
+
+static
+void*
+run_pool(void* arg)
+{
+	worker* ww = (worker*)arg;
+	long done = 0;
+
+	while (done < ww->ops) {
+		cell* xs = 0;
+		for (long ii = 0; ii < LIST_LEN; ii++)
+			xs = pool_cons(cell_pool, ii, xs);
+
+		cell* ys = pool_copy_list(cell_pool, xs);
+		if (count_list(ys) != LIST_LEN)
+			abort();
+
+		pool_free_list(cell_pool, xs);
+		pool_free_list(cell_pool, ys);
+		done += 4 * LIST_LEN;
+	}
+
+	ww->ops = done;
+	return NULL;
+}
+
+static
+void
+free_slots(void** slots)
+{
+	for (long ii = 0; ii < SLOTS; ii++) {
+		if (slots[ii])
+			xfree(slots[ii]);
+	}
+}
+
+// Returns the number of ops done.
+static
+long
+run_pattern(const char* pattern)
+{
+	worker* ws = calloc(nthreads, sizeof(worker));
+	ring* rings = calloc(nthreads, sizeof(ring));
+	void* (*fn)(void*) = NULL;
+	long total = 0;
+
+	if (!strcmp(pattern, "prodcons"))
+		fn = run_prodcons;
+	else if (!strcmp(pattern, "larson"))
+		fn = run_larson;
+	else if (!strcmp(pattern, "random"))
+		fn = run_random;
+	else if (!strcmp(pattern, "fixed"))
+		fn = run_fixed;
+	else if (!strcmp(pattern, "lists"))
+		fn = run_lists;
+	else if (!strcmp(pattern, "arena"))
+		fn = run_arena;
+	else if (!strcmp(pattern, "pool"))
+		fn = run_pool;
+	else
+		return -1;
+
+	for (long ii = 0; ii < nthreads; ii++) {
+		ws[ii].id = ii;
+		ws[ii].rng = 0x9e3779b97f4a7c15ull * (ii + 1);
+		ws[ii].slots = calloc(SLOTS, sizeof(void*));
+		ws[ii].in = &rings[ii];
+		ws[ii].out = &rings[(ii + 1) % nthreads];
+	}
+
+	long rounds = fn == run_larson ? ROUNDS : 1;
+
+	if (fn == run_pool && !(cell_pool = xpool_create(sizeof(cell), _Alignof(cell), 0)))
+		out_of_memory("xpool_create", sizeof(cell));
+
+	for (long rr = 0; rr < rounds; rr++) {
+		for (long ii = 0; ii < nthreads; ii++) {
+			ws[ii].ops = ops_per_thread;
+			pthread_create(&ws[ii].thread, NULL, fn, &ws[ii]);
+		}
+
+		for (long ii = 0; ii < nthreads; ii++) {
+			pthread_join(ws[ii].thread, NULL);
+			total += ws[ii].ops;
+		}
+	}
+
+	for (long ii = 0; ii < nthreads; ii++) {
+		free_slots(ws[ii].slots);
+		free(ws[ii].slots);
+	}
+
+	if (cell_pool)
+		xpool_destroy(cell_pool);
+
+	free(rings);
+	free(ws);
+	return total;
+}
+
+int
+main(int argc, char* argv[])
+{
+	struct timespec t0, t1;
+	struct rusage ru;
+
+	if (argc < 3 || argc > 4) {
+		printf("Usage:\n\t%s prodcons|larson|random|fixed|lists|arena|pool threads [ops-per-thread]\n", argv[0]);
+		return 1;
+	}
+
+	nthreads = atol(argv[2]);
+	if (nthreads < 1)
+		nthreads = 1;
+	if (argc == 4)
+		ops_per_thread = atol(argv[3]);
+
+	const char* backend = strrchr(argv[0], '-');
+	backend = backend ? backend + 1 : argv[0];
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	long ops = run_pattern(argv[1]);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	if (ops < 0) {
+		fprintf(stderr, "%s: unknown pattern %s\n", argv[0], argv[1]);
+		return 1;
+	}
+
+	double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	getrusage(RUSAGE_SELF, &ru);
+
+	printf("%s,%s,%ld,%ld,%.4f,%.0f,%ld\n",
+			backend, argv[1], nthreads, ops, secs, ops / secs, ru.ru_maxrss);
+	return 0;
+}
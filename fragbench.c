@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "xmalloc.h"
+
+// Memory efficiency under fragmentation, with frag_main.c's size mix at a
+// larger scale and over several rounds. Prints one CSV line per phase:
+//
+//   backend,round,phase,live_kb,mapped_kb,resident_kb,mapped_ratio,resident_ratio,largest_kb
+//
+// live_kb is the bytes requested and not yet freed; mapped_kb and
+// resident_kb are the growth in address space and RSS since startup, and
+// the ratios are those over live_kb. largest_kb is the biggest single
+// xmalloc() that still succeeds under the address space limit.
+//
+//   fill     allocate frag_main sizes, writing every byte, up to live-MiB
+//   free     free every other block, alternating which half each round
+//   refill   allocate fresh sizes into the holes, up to live-MiB again
+//   freeall  free everything
+//   trim     call xmalloc_trim()
+//
+// The limit is limit-MiB on top of the address space in use at startup,
+// as frag_main's RLIMIT_AS is, only scaled up with the live bytes.
+
+// From frag_main.c, built into frag_sizes.o with its main() renamed.
+long next_size();
+
+static void** blocks = NULL;
+static size_t* sizes = NULL;
+static size_t nblocks = 0;
+static size_t live = 0;
+static long base_pages = 0;
+static long base_resident = 0;
+static size_t limit = 0;
+static const char* backend = "";
+
+static
+void
+statm(long* pages, long* resident)
+{
+	char buf[128];
+	int fd = open("/proc/self/statm", O_RDONLY);
+	ssize_t nn = fd < 0 ? -1 : read(fd, buf, sizeof(buf) - 1);
+
+	*pages = *resident = 0;
+	if (nn > 0) {
+		buf[nn] = 0;
+		sscanf(buf, "%ld %ld", pages, resident);
+	}
+	if (fd >= 0)
+		close(fd);
+}
+
+// Whether xmalloc(bytes) succeeds, tried in a forked child so nothing it
+// maps stays behind: xv6_malloc, for one, keeps every page it gets. The
+// failed maps are expected, so the child's complaints go to /dev/null.
+static
+int
+can_alloc(size_t bytes)
+{
+	int status;
+
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fragbench: fork() failed");
+		exit(1);
+	}
+
+	if (pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+		if (null >= 0)
+			dup2(null, 2);
+		_exit(xmalloc(bytes) ? 0 : 1);
+	}
+
+	if (waitpid(pid, &status, 0) == -1)
+		return 0;
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Binary search, to the page, for the largest block that still fits.
+static
+size_t
+largest_alloc()
+{
+	size_t lo = 0;
+	size_t hi = limit + 1;
+
+	while (hi - lo > 4096) {
+		size_t mid = (lo + (hi - lo) / 2) & ~(size_t)4095;
+		if (can_alloc(mid))
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static
+void
+report(long round, const char* phase)
+{
+	long pages, resident;
+	statm(&pages, &resident);
+
+	long mapped_kb = (pages - base_pages) * 4;
+	long resident_kb = (resident - base_resident) * 4;
+	double live_kb = live / 1024.0;
+
+	printf("%s,%ld,%s,%.0f,%ld,%ld,%.3f,%.3f,%zu\n",
+			backend, round, phase, live_kb, mapped_kb, resident_kb,
+			live ? mapped_kb / live_kb : 0.0,
+			live ? resident_kb / live_kb : 0.0,
+			largest_alloc() / 1024);
+}
+
+// Fill empty slots, oldest first, until target bytes are live or there
+// are no slots left.
+static
+void
+fill(size_t target)
+{
+	for (size_t ii = 0; ii < nblocks && live < target; ii++) {
+		if (blocks[ii])
+			continue;
+
+		size_t size = next_size();
+		void* ptr = xmalloc(size);
+		if (!ptr) {
+			fprintf(stderr, "fragbench: xmalloc(%zu) failed at %zu KiB live\n", size, live / 1024);
+			return;
+		}
+
+		memset(ptr, 0x99, size);
+		blocks[ii] = ptr;
+		sizes[ii] = size;
+		live += size;
+	}
+}
+
+static
+void
+free_every_other(long round)
+{
+	for (size_t ii = round % 2; ii < nblocks; ii += 2) {
+		if (blocks[ii]) {
+			xfree(blocks[ii]);
+			live -= sizes[ii];
+			blocks[ii] = NULL;
+		}
+	}
+}
+
+int
+main(int argc, char* argv[])
+{
+	struct rlimit lim;
+
+	if (argc > 4) {
+		printf("Usage:\n\t%s [live-MiB [rounds [limit-MiB]]]\n", argv[0]);
+		return 1;
+	}
+
+	size_t live_mb = argc > 1 ? atol(argv[1]) : 32;
+	long rounds = argc > 2 ? atol(argv[2]) : 4;
+	size_t limit_mb = argc > 3 ? atol(argv[3]) : 4 * live_mb + 16;
+	size_t target = live_mb << 20;
+
+	backend = strrchr(argv[0], '-');
+	backend = backend ? backend + 1 : argv[0];
+
+	// frag_main sizes average about 11 KiB, so this is plenty.
+	nblocks = target / 256 + 1;
+	blocks = calloc(nblocks, sizeof(void*));
+	sizes = calloc(nblocks, sizeof(size_t));
+	if (!blocks || !sizes) {
+		perror("fragbench: calloc() failed");
+		return 1;
+	}
+
+	statm(&base_pages, &base_resident);
+	limit = limit_mb << 20;
+	lim.rlim_cur = lim.rlim_max = base_pages * 4096 + limit;
+	if (setrlimit(RLIMIT_AS, &lim) == -1) {
+		perror("fragbench: setrlimit() failed");
+		return 1;
+	}
+
+	fill(target);
+	report(0, "fill");
+
+	for (long round = 1; round <= rounds; round++) {
+		free_every_other(round);
+		report(round, "free");
+		fill(target);
+		report(round, "refill");
+	}
+
+	free_every_other(0);
+	free_every_other(1);
+	report(rounds, "freeall");
+	xmalloc_trim();
+	report(rounds, "trim");
+
+	free(sizes);
+	free(blocks);
+	return 0;
+}
@@ -1,3 +1,4 @@
+
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <stdio.h>
@@ -6,15 +7,48 @@
 #include <pthread.h>
 
 #include "xmalloc.h"
-
+#include "pages.h"
+#include "reclaim.h"
+#include "stats.h"
+
+// Every block starts with a size_t header holding its size and flag bits.
+// Free blocks also carry red-black tree links and a footer copy of the size
+// in their last word, so a freed block can find and merge with both
+// physical neighbours without searching the free tree.
+//
+//   allocated: [ size|flags | payload ...                              ]
+//   free:      [ size|flags | left | right | parent | ...       | size ]
+//
+// The free tree is ordered by (size, address): the leftmost block that is
+// big enough is the best fit, and among equal sizes the lowest address.
+// Large blocks have a mapping of their own and are flagged MAPPED. Their
+// header holds the length of the whole mapping, which starts at the page
+// the header is on; the payload is 16 bytes in, or further for aligned
+// blocks.
+//
+// A free block carved only from pages that came zero is flagged CLEAN:
+// everything but its header, tree links and footer is still zero. Only
+// in-use blocks are ever MAPPED, so the two share a bit.
 typedef struct block {
 	size_t size;
-	struct block* next;
+	struct block* left;
+	struct block* right;
+	struct block* parent;
 } block;
 
-block* fHEAD = NULL;
+#define INUSE      ((size_t)1)
+#define PREV_INUSE ((size_t)2)
+#define RED        ((size_t)4)
+#define MAPPED     ((size_t)8)
+#define CLEAN      ((size_t)8)
+#define FLAGS      (INUSE | PREV_INUSE | RED | MAPPED)
+
+block* fROOT = NULL;
+size_t free_bytes = 0;    // total size of the blocks in the free tree
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 const size_t PAGE_SIZE = 4096;
+const size_t MIN_BLOCK = 48;
+const size_t GROW_SIZE = 16 * 4096;
 
 static
 size_t
@@ -32,180 +66,602 @@ div_up(size_t xx, size_t yy)
     }
 }
 
-long
-free_list_add(void* addr, size_t size)
+static
+size_t
+block_size(block* bb)
 {
-	block* toAdd = (block*)(addr);
-	block* tmp = fHEAD;
-	block* tmp_prev = NULL;
-	long insIdx = 0;
-	
-	// put new cell where prev entry has lower addr and next entry has greater addr
-	// addr won't be equal because mmap will create new blocks in unused parts of memory
-	if (tmp && (uintptr_t)tmp < (uintptr_t)addr) {
-
-		while (tmp && (uintptr_t)tmp < (uintptr_t)addr) {
-			tmp_prev = tmp;
-			tmp = tmp->next;
-			insIdx += 1;
+	return bb->size & ~FLAGS;
+}
+
+static
+block*
+block_next(block* bb)
+{
+	return (block*)((void*)bb + block_size(bb));
+}
+
+static
+void
+block_set_footer(block* bb)
+{
+	*((size_t*)((void*)bb + block_size(bb) - sizeof(size_t))) = block_size(bb);
+}
+
+static
+int
+is_red(block* bb)
+{
+	return bb && (bb->size & RED);
+}
+
+static
+int
+block_less(block* aa, block* bb)
+{
+	if (block_size(aa) != block_size(bb))
+		return block_size(aa) < block_size(bb);
+	return (uintptr_t)aa < (uintptr_t)bb;
+}
+
+static
+void
+free_tree_replace(block* old, block* new)
+{
+	if (!old->parent)
+		fROOT = new;
+	else if (old == old->parent->left)
+		old->parent->left = new;
+	else
+		old->parent->right = new;
+
+	if (new)
+		new->parent = old->parent;
+}
+
+static
+void
+rotate_left(block* xx)
+{
+	block* yy = xx->right;
+
+	xx->right = yy->left;
+	if (yy->left)
+		yy->left->parent = xx;
+
+	free_tree_replace(xx, yy);
+	yy->left = xx;
+	xx->parent = yy;
+}
+
+static
+void
+rotate_right(block* xx)
+{
+	block* yy = xx->left;
+
+	xx->left = yy->right;
+	if (yy->right)
+		yy->right->parent = xx;
+
+	free_tree_replace(xx, yy);
+	yy->right = xx;
+	xx->parent = yy;
+}
+
+static
+void
+free_tree_insert(block* zz)
+{
+	block* pp = NULL;
+	block* tmp = fROOT;
+
+	free_bytes += block_size(zz);
+
+	while (tmp) {
+		pp = tmp;
+		tmp = block_less(zz, tmp) ? tmp->left : tmp->right;
+	}
+
+	zz->parent = pp;
+	zz->left = NULL;
+	zz->right = NULL;
+	zz->size |= RED;
+
+	if (!pp)
+		fROOT = zz;
+	else if (block_less(zz, pp))
+		pp->left = zz;
+	else
+		pp->right = zz;
+
+	while (is_red(zz->parent)) {
+		pp = zz->parent;
+		block* gg = pp->parent;
+
+		if (pp == gg->left) {
+			block* uu = gg->right;
+
+			if (is_red(uu)) {
+				pp->size &= ~RED;
+				uu->size &= ~RED;
+				gg->size |= RED;
+				zz = gg;
+				continue;
+			}
+
+			if (zz == pp->right) {
+				zz = pp;
+				rotate_left(zz);
+				pp = zz->parent;
+			}
+
+			pp->size &= ~RED;
+			gg->size |= RED;
+			rotate_right(gg);
+		}
+		else {
+			block* uu = gg->left;
+
+			if (is_red(uu)) {
+				pp->size &= ~RED;
+				uu->size &= ~RED;
+				gg->size |= RED;
+				zz = gg;
+				continue;
+			}
+
+			if (zz == pp->left) {
+				zz = pp;
+				rotate_right(zz);
+				pp = zz->parent;
+			}
+
+			pp->size &= ~RED;
+			gg->size |= RED;
+			rotate_left(gg);
 		}
-	
-		toAdd->size = size;
-		toAdd->next = tmp;
-		if (tmp_prev)
-			tmp_prev->next = toAdd;
 	}
-	else {
-		toAdd->size = size;
-		toAdd->next = fHEAD;
-		fHEAD = toAdd;
+
+	fROOT->size &= ~RED;
+}
+
+// Restore the red-black invariants after removing a black node, where xx
+// (possibly NULL) now carries the missing black and pp is its parent.
+static
+void
+free_tree_delete_fixup(block* xx, block* pp)
+{
+	while (xx != fROOT && !is_red(xx)) {
+		if (xx == pp->left) {
+			block* ww = pp->right;
+
+			if (is_red(ww)) {
+				ww->size &= ~RED;
+				pp->size |= RED;
+				rotate_left(pp);
+				ww = pp->right;
+			}
+
+			if (!is_red(ww->left) && !is_red(ww->right)) {
+				ww->size |= RED;
+				xx = pp;
+				pp = xx->parent;
+			}
+			else {
+				if (!is_red(ww->right)) {
+					ww->left->size &= ~RED;
+					ww->size |= RED;
+					rotate_right(ww);
+					ww = pp->right;
+				}
+
+				ww->size = (ww->size & ~RED) | (pp->size & RED);
+				pp->size &= ~RED;
+				ww->right->size &= ~RED;
+				rotate_left(pp);
+				xx = fROOT;
+			}
+		}
+		else {
+			block* ww = pp->left;
+
+			if (is_red(ww)) {
+				ww->size &= ~RED;
+				pp->size |= RED;
+				rotate_right(pp);
+				ww = pp->left;
+			}
+
+			if (!is_red(ww->left) && !is_red(ww->right)) {
+				ww->size |= RED;
+				xx = pp;
+				pp = xx->parent;
+			}
+			else {
+				if (!is_red(ww->left)) {
+					ww->right->size &= ~RED;
+					ww->size |= RED;
+					rotate_left(ww);
+					ww = pp->left;
+				}
+
+				ww->size = (ww->size & ~RED) | (pp->size & RED);
+				pp->size &= ~RED;
+				ww->left->size &= ~RED;
+				rotate_right(pp);
+				xx = fROOT;
+			}
+		}
 	}
-	
-	return insIdx;
+
+	if (xx)
+		xx->size &= ~RED;
 }
 
-long
-free_list_coalesce()
+void
+free_tree_delete(block* zz)
 {
-	long n = 0;
-	char del = 0;
+	block* xx = NULL;
+	block* pp = NULL;
+	int removed_red = is_red(zz);
+
+	free_bytes -= block_size(zz);
+
+	if (!zz->left) {
+		xx = zz->right;
+		pp = zz->parent;
+		free_tree_replace(zz, zz->right);
+	}
+	else if (!zz->right) {
+		xx = zz->left;
+		pp = zz->parent;
+		free_tree_replace(zz, zz->left);
+	}
+	else {
+		// zz has two children: splice in its in-order successor yy
+		block* yy = zz->right;
+		while (yy->left)
+			yy = yy->left;
 
-	do {
+		removed_red = is_red(yy);
+		xx = yy->right;
 
-		block* tmp = fHEAD;
-		block* tmp_prev = NULL;
-		del = 0;
+		if (yy->parent == zz) {
+			pp = yy;
+		}
+		else {
+			pp = yy->parent;
+			free_tree_replace(yy, yy->right);
+			yy->right = zz->right;
+			yy->right->parent = yy;
+		}
 
-		while (tmp) {
+		free_tree_replace(zz, yy);
+		yy->left = zz->left;
+		yy->left->parent = yy;
+		yy->size = (yy->size & ~RED) | (zz->size & RED);
+	}
 
-			if (tmp_prev && (void*)(tmp_prev) + tmp_prev->size == (void*)(tmp)) {
-				tmp_prev->size = tmp_prev->size + tmp->size;	
-				tmp_prev->next = tmp_prev->next->next;
-				n += 1;
-				del = 1;
-			}
+	if (!removed_red)
+		free_tree_delete_fixup(xx, pp);
+}
+
+// Best fit: the smallest free block of at least size bytes, or NULL.
+block*
+free_tree_find(size_t size)
+{
+	block* tmp = fROOT;
+	block* best = NULL;
 
-			tmp_prev = tmp;
-			tmp = tmp->next;
+	while (tmp) {
+		if (block_size(tmp) >= size) {
+			best = tmp;
+			tmp = tmp->left;
+		}
+		else {
+			tmp = tmp->right;
 		}
+	}
+
+	return best;
+}
 
-	} while (del == 1);
+// clean is CLEAN if the range is zero past where the new block's
+// header, links and footer go, 0 otherwise.
+void
+free_tree_add(void* addr, size_t size, size_t clean)
+{
+	block* toAdd = (block*)(addr);
 
-	return n;
+	// A free block's left neighbour is always in use, otherwise they
+	// would have been merged.
+	toAdd->size = size | PREV_INUSE | clean;
+	free_tree_insert(toAdd);
+
+	block_set_footer(toAdd);
+	block_next(toAdd)->size &= ~PREV_INUSE;
 }
 
+// Merge the free range [addr, addr + size) with any free physical
+// neighbours and put the result in the free tree. Must hold mutex.
+static
 void
-free_list_delete(long idx)
+free_block(void* addr, size_t size, size_t prev_inuse)
 {
-	long prev_idx = 0;
-	block* tmp = fHEAD;
+	block* bb = (block*)(addr);
+	block* next = (block*)(addr + size);
+
+	if (!prev_inuse) {
+		size_t prev_size = *((size_t*)(addr - sizeof(size_t)));
+		bb = (block*)(addr - prev_size);
+		free_tree_delete(bb);
+		size += prev_size;
+	}
+
+	if (!(next->size & INUSE)) {
+		free_tree_delete(next);
+		size += block_size(next);
+	}
 
-	if (idx == 0) {
-		fHEAD = tmp->next;
+	// A whole GROW_SIZE region free again goes back to the page source
+	// while there is plenty of other free space to serve from.
+	if (((uintptr_t)bb & (PAGE_SIZE - 1)) == sizeof(size_t) && size == GROW_SIZE - 2 * sizeof(size_t)
+			&& free_bytes >= GROW_SIZE) {
+		pages_free((void*)bb - sizeof(size_t), GROW_SIZE);
 		return;
 	}
 
-	while (prev_idx < idx - 1) {
-		tmp = tmp->next;
-		prev_idx += 1;
+	free_tree_add(bb, size, 0);
+}
+
+// Carve an in-use block of `size` bytes off the front of free block bb,
+// returning any tail big enough to stand alone. Must hold mutex.
+static
+void
+block_split(block* bb, size_t size)
+{
+	size_t total = block_size(bb);
+	size_t clean = bb->size & CLEAN;
+
+	free_tree_delete(bb);
+
+	if (total - size >= MIN_BLOCK) {
+		bb->size = size | INUSE | PREV_INUSE;
+		free_tree_add((void*)bb + size, total - size, clean);
+	}
+	else {
+		bb->size = total | INUSE | PREV_INUSE;
+		block_next(bb)->size |= PREV_INUSE;
 	}
+}
 
-	tmp->next = tmp->next->next;
+// Take GROW_SIZE more bytes from the page source and add them to the free
+// tree. The last word of the region is an in-use epilogue header with size
+// 0 so frees never look past the end, and the first block claims an in-use
+// predecessor for the same reason at the front. Must hold mutex.
+static
+int
+free_tree_grow()
+{
+	int clean;
+	void* ptr = pages_alloc_clean(GROW_SIZE, PAGE_SIZE, &clean);
+	if (!ptr)
+		return 0;
+
+	block* epilogue = (block*)(ptr + GROW_SIZE - sizeof(size_t));
+	epilogue->size = INUSE;
+
+	free_tree_add(ptr + sizeof(size_t), GROW_SIZE - 2 * sizeof(size_t), clean ? CLEAN : 0);
+	return 1;
 }
 
-void*
-xmalloc(size_t size)
+static
+size_t
+block_request(size_t bytes)
 {
-	void* ptr = NULL;
+	size_t size = (bytes + sizeof(size_t) + 15) & ~(size_t)15;
+
+	if (size < MIN_BLOCK)
+		return MIN_BLOCK;
+	return size;
+}
 
-    size += sizeof(size_t);
+// Carve an in-use block of `size` bytes whose payload is aligned to align
+// out of free block bb, which must hold size + align + MIN_BLOCK bytes. The
+// slack in front becomes a free block of its own. Must hold mutex.
+static
+block*
+block_split_aligned(block* bb, size_t size, size_t align)
+{
+	uintptr_t payload = (uintptr_t)bb + sizeof(size_t);
+	uintptr_t aligned = (payload + align - 1) & ~(uintptr_t)(align - 1);
 
-	if (size < PAGE_SIZE) {
+	if (aligned == payload) {
+		block_split(bb, size);
+		return bb;
+	}
 
-		pthread_mutex_lock(&mutex);
-		block* tmp = fHEAD;
-		long idx = 0;
-		
-		// search free list for block
-		while (tmp) {
+	while (aligned - payload < MIN_BLOCK)
+		aligned += align;
 
-			// give whole free entry
-			if (tmp->size - size < sizeof(block) && tmp->size >= size) {
-				ptr = (void*)tmp;	
-				*((size_t*)(ptr)) = size;
-				//printf("Full : Thread %ld taking %p\n\n", pthread_self(), ptr);
+	size_t gap = aligned - payload;
+	size_t rest = block_size(bb) - gap;
+	size_t clean = bb->size & CLEAN;
+	block* start = (block*)(aligned - sizeof(size_t));
 
-				free_list_delete(idx);
+	free_tree_delete(bb);
+	free_tree_add(bb, gap, clean);
 
-				break;
-			} // end if
-			// split free entry
-			else if (tmp->size - size >= sizeof(block) && tmp->size >= size) {
-				ptr = (void*)tmp;
+	if (rest - size >= MIN_BLOCK) {
+		start->size = size | INUSE;
+		free_tree_add((void*)start + size, rest - size, clean);
+	}
+	else {
+		start->size = rest | INUSE;
+		block_next(start)->size |= PREV_INUSE;
+	}
+
+	return start;
+}
 
-				void* new_addr = ptr + size;
-				long insIdx = free_list_add(new_addr, tmp->size - size);
+// Best fit for a block of `size` bytes aligned to align, growing the heap
+// until one fits unless told not to. Sets *clean (if clean is not NULL)
+// when it came from a CLEAN free block. Must hold mutex.
+static
+block*
+block_take(size_t size, size_t align, int grow, int* clean)
+{
+	size_t need = align > 16 ? size + align + MIN_BLOCK : size;
 
-				*((size_t*)(ptr)) = size;
-				//printf("Split: Thread %ld taking %p\n\n", pthread_self(), ptr);
+	for (;;) {
+		block* tmp = free_tree_find(need);
 
-				// split
-				free_list_delete(insIdx - 1);
-				free_list_coalesce();
+		if (tmp && clean)
+			*clean = (tmp->size & CLEAN) != 0;
 
-				break;
-			} // end else if
+		if (tmp && align > 16)
+			return block_split_aligned(tmp, size, align);
+
+		if (tmp) {
+			block_split(tmp, size);
+			return tmp;
+		}
+
+		if (!grow || !free_tree_grow())
+			return NULL;
+	}
+}
+
+static
+void*
+mapped_start(block* bb)
+{
+	return (void*)((uintptr_t)bb & ~(uintptr_t)(PAGE_SIZE - 1));
+}
+
+static
+size_t
+usable_size(block* bb)
+{
+	if (bb->size & MAPPED)
+		return mapped_start(bb) + block_size(bb) - (void*)bb - sizeof(size_t);
+	return block_size(bb) - sizeof(size_t);
+}
+
+// Give a large block a mapping of its own, with the payload aligned to
+// align (a power of two, at least 16). Up to a page of alignment costs
+// at most an extra page; past that the block is over-mapped and the ends
+// are given back.
+static
+void*
+mapped_alloc(size_t bytes, size_t align)
+{
+	size_t offset = align;
+	size_t extra = 0;
+
+	if (align > PAGE_SIZE) {
+		offset = PAGE_SIZE;
+		extra = align;
+	}
+
+	if (bytes > SIZE_MAX / 2 - offset - extra)
+		return NULL;
 
-			tmp = tmp->next;
-			idx += 1;
-		} // end while
-	
-		// if not found
-		if (!ptr) {
+	size_t len = div_up(offset + bytes, PAGE_SIZE) * PAGE_SIZE;
+	void* base = reclaim_map(len + extra);
+	if (!base)
+		return NULL;
 
-			ptr = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-			if (ptr == (void*)(-1))
-				perror("xmalloc: mmap() failed");
-			//printf("mmap : Thread %ld taking %p\n", pthread_self(), ptr);
+	if (extra) {
+		void* ptr = (void*)(((uintptr_t)base + offset + align - 1) & ~(uintptr_t)(align - 1));
+		void* start = ptr - offset;
+
+		if (start > base)
+			pages_unmap(base, start - base);
+		if (base + extra > start)
+			pages_unmap(start + len, base + extra - start);
+		base = start;
+	}
+
+	block* bb = (block*)(base + offset - sizeof(size_t));
+	bb->size = len | INUSE | MAPPED;
+	return base + offset;
+}
+
+// Sets *clean (if clean is not NULL) when the block is known to be zero
+// past the words a CLEAN free block uses.
+static
+void*
+block_alloc(size_t bytes, size_t align, int* clean)
+{
+	void* ptr = NULL;
+	size_t size = block_request(bytes);
+	size_t need = align > 16 ? size + align + MIN_BLOCK : size;
 
-			free_list_add(ptr, PAGE_SIZE);
-			free_list_coalesce();
+	if (need <= PAGE_SIZE - 2 * sizeof(size_t)) {
+		xstats_lock(&mutex);
+		block* bb = block_take(size, align, !reclaim_on, clean);
+		pthread_mutex_unlock(&mutex);
 
+		// With frees deferred, reclaim them before growing the heap.
+		if (!bb && reclaim_on) {
+			reclaim_drain();
+			xstats_lock(&mutex);
+			bb = block_take(size, align, 1, clean);
 			pthread_mutex_unlock(&mutex);
-			return xmalloc(size - sizeof(size_t));
 		}
-		
-	} // end if
+
+		if (bb)
+			ptr = (void*)bb + sizeof(size_t);
+	}
 	else {
-		size_t pages = div_up(size, PAGE_SIZE);
+		ptr = mapped_alloc(bytes, align);
+	}
 
-		ptr = mmap(NULL, pages * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-		if (ptr == (void*)(-1))
-			perror("xmalloc: mmap() failed");
+	if (ptr) {
+		size_t usable = usable_size((block*)(ptr - sizeof(size_t)));
+		xstats_alloc(xstats_class(usable), usable);
+	}
 
-		*((size_t*)(ptr)) = pages * PAGE_SIZE;
-	} // end else
-	
-	pthread_mutex_unlock(&mutex);
-	return ptr + sizeof(size_t);
-} // end hmalloc
+	return ptr;
+}
+
+void*
+xmalloc(size_t bytes)
+{
+	return block_alloc(bytes, 16, NULL);
+}
+
+// Small aligned blocks are carved out of a free block with room to slide
+// forward, handing the slack on both sides back to the free tree.
+void*
+xmalloc_aligned(size_t align, size_t bytes)
+{
+	if (align & (align - 1))
+		return NULL;
+
+	return block_alloc(bytes, align < 16 ? 16 : align, NULL);
+}
 
 void
 xfree(void* item)
 {
-	size_t size = *((size_t*)(item - sizeof(size_t)));
+	block* bb = (block*)(item - sizeof(size_t));
+	size_t size = block_size(bb);
+	size_t usable = usable_size(bb);
+
+	if (reclaim_on && reclaim_push(item, usable))
+		return;
 
-	if (size < PAGE_SIZE) {
-		pthread_mutex_lock(&mutex);
-		free_list_add(item - sizeof(size_t), size);
-		free_list_coalesce();
+	xstats_free(xstats_class(usable), usable);
+
+	if (!(bb->size & MAPPED)) {
+		xstats_lock(&mutex);
+		free_block((void*)bb, size, bb->size & PREV_INUSE);
 		pthread_mutex_unlock(&mutex);
 	}
 	else {
-		int err = munmap(item - sizeof(size_t), size);
-		if (err == -1)
-			perror("xfree: munmap() failed");
-
+		pages_unmap(mapped_start(bb), size);
 	}
 
 }
@@ -214,65 +670,243 @@ void*
 xrealloc(void* prev, size_t bytes)
 {
 	void* ptr = NULL;
-	size_t oldBytes = *((size_t*)(prev - sizeof(size_t)));
-	size_t newBytes = bytes + sizeof(size_t);
-	long idx = 0;
-
-	pthread_mutex_lock(&mutex);
-	block* tmp = fHEAD;
-
-	// Search free list to see if we can extend current allocation to avoid memcpy
-	while (tmp) {
+	block* bb = (block*)(prev - sizeof(size_t));
+	size_t oldSize = block_size(bb);
+	size_t newSize = block_request(bytes);
+
+	if (!(bb->size & MAPPED) && newSize <= PAGE_SIZE - 2 * sizeof(size_t)) {
+		xstats_lock(&mutex);
+
+		block* next = block_next(bb);
+		block* start = bb;
+		size_t flags = bb->size & (INUSE | PREV_INUSE);
+		size_t avail = oldSize;
+
+		// Extend into the following block if it is free, avoiding the memcpy
+		if (!(next->size & INUSE))
+			avail += block_size(next);
+
+		// Failing that, slide back into a free block in front of this one,
+		// which costs a memmove but no new allocation
+		if (newSize > avail && !(bb->size & PREV_INUSE)) {
+			size_t prev_size = *((size_t*)((void*)bb - sizeof(size_t)));
+
+			if (newSize <= avail + prev_size) {
+				start = (block*)((void*)bb - prev_size);
+				avail += prev_size;
+			}
+		}
 
-		if ((uintptr_t)(prev - sizeof(size_t)) + oldBytes == (uintptr_t)(tmp) && newBytes <= oldBytes + tmp->size) {
+		if (newSize <= avail) {
+			if (!(next->size & INUSE))
+				free_tree_delete(next);
 
-			if ((oldBytes + tmp->size) - newBytes < sizeof(block)) {
-				ptr = prev;
-				*((size_t*)(ptr - sizeof(size_t))) = oldBytes + tmp->size;
+			if (start != bb) {
+				free_tree_delete(start);
+				flags = INUSE | PREV_INUSE;
+				memmove((void*)start + sizeof(size_t), prev, oldSize - sizeof(size_t));
+			}
 
-				free_list_delete(idx);
-				
-				pthread_mutex_unlock(&mutex);
-				return ptr;
+			if (avail - newSize >= MIN_BLOCK) {
+				start->size = newSize | flags;
+				free_block((void*)start + newSize, avail - newSize, INUSE);
 			}
 			else {
-				ptr = prev;
-				*((size_t*)(ptr - sizeof(size_t))) = newBytes;
-
-				void* addr = ptr + bytes;
-				long insIdx = free_list_add(addr, (oldBytes + tmp->size) - newBytes);
+				start->size = avail | flags;
+				block_next(start)->size |= PREV_INUSE;
+			}
 
-				free_list_delete(insIdx - 1);
-				free_list_coalesce();
+			pthread_mutex_unlock(&mutex);
 
-				pthread_mutex_unlock(&mutex);
-				return ptr;
-			}
-			
+			// Count the move between classes as a free and an allocation
+			xstats_free(xstats_class(oldSize - sizeof(size_t)), oldSize - sizeof(size_t));
+			xstats_alloc(xstats_class(block_size(start) - sizeof(size_t)), block_size(start) - sizeof(size_t));
+			return (void*)start + sizeof(size_t);
 		}
 
-		tmp = tmp->next;
-		idx += 1;
+		pthread_mutex_unlock(&mutex);
 	}
-	pthread_mutex_unlock(&mutex);
 
 	// If program got here, it didn't return
 	// So use xmalloc() to find new memspace and copy prev data over, then free old space
+	size_t have = usable_size(bb);
+
 	ptr = xmalloc(bytes);
-	memcpy(ptr, prev, *((size_t*)(prev - sizeof(size_t))) - sizeof(block));
+	if (!ptr)
+		return NULL;
+
+	if (have < bytes)
+		memcpy(ptr, prev, have);
+	else
+		memcpy(ptr, prev, bytes);
 	xfree(prev);
 
 	return ptr;
 }
 
+// Freeing coalesces through the boundary tags, which have to be read
+// anyway, so the size is only checked, never used.
 void
-dump_flist()
+xfree_sized(void* ptr, size_t size)
 {
-	block* tmp = fHEAD;
+#ifdef XMALLOC_DEBUG
+	if (size > usable_size((block*)(ptr - sizeof(size_t)))) {
+		fprintf(stderr, "xfree_sized: %p is not a block of %zu bytes\n", ptr, size);
+		abort();
+	}
+#endif
 
-	while (tmp) {
-		printf("addr: %p ; size: %ld\n", tmp, tmp->size);
-		tmp = tmp->next;
+	xfree(ptr);
+}
+
+// Drop the pages inside every free block in the subtree under bb. The
+// tree links at the front and the footer at the back stay. Must hold
+// mutex.
+static
+size_t
+free_tree_discard(block* bb)
+{
+	if (!bb)
+		return 0;
+
+	return pages_discard((void*)bb + sizeof(block), block_size(bb) - sizeof(block) - sizeof(size_t))
+		+ free_tree_discard(bb->left) + free_tree_discard(bb->right);
+}
+
+// Release every whole free region to the page source and purge it, then
+// drop the pages inside what is left of the free tree.
+int
+xmalloc_trim()
+{
+	block* bb;
+	size_t bytes;
+
+	reclaim_drain();
+
+	xstats_lock(&mutex);
+	while ((bb = free_tree_find(GROW_SIZE - 2 * sizeof(size_t)))) {
+		free_tree_delete(bb);
+		pages_free((void*)bb - sizeof(size_t), GROW_SIZE);
+	}
+	bytes = free_tree_discard(fROOT);
+	pthread_mutex_unlock(&mutex);
+
+	return pages_purge(1) + bytes > 0;
+}
+
+// Blocks small enough for the free tree are all carved under one lock.
+size_t
+xmalloc_batch(size_t bytes, size_t nn, void** out)
+{
+	size_t size = block_request(bytes);
+	size_t ii = 0;
+
+	if (size > PAGE_SIZE - 2 * sizeof(size_t)) {
+		for (; ii < nn; ii++) {
+			if (!(out[ii] = xmalloc(bytes)))
+				break;
+		}
+		return ii;
 	}
+
+	xstats_lock(&mutex);
+	for (; ii < nn; ii++) {
+		block* bb = block_take(size, 16, 1, NULL);
+		if (!bb)
+			break;
+		out[ii] = (void*)bb + sizeof(size_t);
+	}
+	pthread_mutex_unlock(&mutex);
+
+	for (size_t jj = 0; jj < ii; jj++) {
+		size_t usable = usable_size((block*)(out[jj] - sizeof(size_t)));
+		xstats_alloc(xstats_class(usable), usable);
+	}
+
+	return ii;
 }
 
+// MAPPED blocks are unmapped up front, the rest go back to the free tree
+// under one lock.
+void
+xfree_batch(void** ptrs, size_t nn)
+{
+	int locked = 0;
+
+	for (size_t ii = 0; ii < nn; ii++) {
+		if (!ptrs[ii])
+			continue;
+
+		block* bb = (block*)(ptrs[ii] - sizeof(size_t));
+		if (bb->size & MAPPED) {
+			xfree(ptrs[ii]);
+			continue;
+		}
+
+		size_t usable = usable_size(bb);
+		xstats_free(xstats_class(usable), usable);
+
+		if (!locked) {
+			xstats_lock(&mutex);
+			locked = 1;
+		}
+		free_block((void*)bb, block_size(bb), bb->size & PREV_INUSE);
+	}
+
+	if (locked)
+		pthread_mutex_unlock(&mutex);
+}
+
+// MAPPED blocks are fresh mappings and already zero. A block carved from
+// a CLEAN free block only needs the tree links at its front and the footer
+// it may have kept at its back cleared; anything else from the free tree
+// is recycled and cleared in full.
+void*
+xcalloc(size_t nn, size_t size)
+{
+	int clean = 0;
+
+	if (size && nn > SIZE_MAX / size)
+		return NULL;
+
+	void* ptr = block_alloc(nn * size, 16, &clean);
+	if (!ptr)
+		return NULL;
+
+	block* bb = (block*)(ptr - sizeof(size_t));
+	if (bb->size & MAPPED)
+		return ptr;
+
+	if (clean) {
+		memset(ptr, 0, sizeof(block) - sizeof(size_t));
+		*((size_t*)((void*)bb + block_size(bb) - sizeof(size_t))) = 0;
+	}
+	else {
+		memset(ptr, 0, nn * size);
+	}
+	return ptr;
+}
+
+size_t
+xmalloc_usable_size(void* ptr)
+{
+	block* bb = (block*)(ptr - sizeof(size_t));
+	return usable_size(bb);
+}
+
+void
+xmalloc_stats(xmalloc_stats_t* st)
+{
+	pages_stats ps;
+
+	xstats_sum(st);
+	xstats_classes(st);
+
+	xstats_lock(&mutex);
+	st->cached = free_bytes;
+	pthread_mutex_unlock(&mutex);
+
+	pages_get_stats(&ps);
+	st->mmaps = ps.mmaps;
+	st->munmaps = ps.munmaps;
+}
@@ -2,6 +2,7 @@
 #define IVEC_H
 
 #include <assert.h>
+#include <string.h>
 
 #include "xmalloc.h"
 
@@ -21,6 +22,7 @@ make_ivec(int cap0)
     xs->cap  = cap0;
     xs->size = 0;
     xs->data = xmalloc(xs->cap * sizeof(long));
+    xs->cap  = xmalloc_usable_size(xs->data) / sizeof(long);
     return xs;
 }
 
@@ -28,8 +30,8 @@ static
 void
 free_ivec(ivec* xs)
 {
-    xfree(xs->data);
-    xfree(xs);
+    xfree_sized(xs->data, xs->cap * sizeof(long));
+    xfree_sized(xs, sizeof(ivec));
 }
 
 static
@@ -37,8 +39,8 @@ void
 ivec_push(ivec* xs, long item)
 {
     if (xs->size >= xs->cap) {
-        xs->cap *= 2;
-        xs->data = xrealloc(xs->data, xs->cap * sizeof(long));
+        xs->data = xrealloc(xs->data, 2 * xs->cap * sizeof(long));
+        xs->cap  = xmalloc_usable_size(xs->data) / sizeof(long);
     }
 
     xs->data[xs->size] = item;
@@ -63,4 +65,35 @@ ivec_copy(ivec* xs)
     return ys;
 }
 
+// An ivec living in an arena, dropped with the rest of it by
+// xarena_reset(). It must grow with arena_ivec_push, never ivec_push or
+// free_ivec; the data it outgrows stays in the arena until the reset.
+static inline
+ivec*
+arena_make_ivec(xarena_t* ar, int cap0)
+{
+    assert(cap0 > 0);
+
+    ivec* xs = xarena_alloc(ar, sizeof(ivec));
+    xs->cap  = cap0;
+    xs->size = 0;
+    xs->data = xarena_alloc(ar, xs->cap * sizeof(long));
+    return xs;
+}
+
+static inline
+void
+arena_ivec_push(xarena_t* ar, ivec* xs, long item)
+{
+    if (xs->size >= xs->cap) {
+        long* data = xarena_alloc(ar, 2 * xs->cap * sizeof(long));
+        memcpy(data, xs->data, xs->size * sizeof(long));
+        xs->data = data;
+        xs->cap  = 2 * xs->cap;
+    }
+
+    xs->data[xs->size] = item;
+    xs->size += 1;
+}
+
 #endif
@@ -37,7 +37,7 @@ free_list(cell* xs)
 {
     while (xs) {
         cell* ys = xs->rest;
-        xfree(xs);
+        xfree_sized(xs, sizeof(cell));
         xs = ys;
     }
 }
@@ -54,5 +54,130 @@ copy_list(cell* xs)
     return cons(xs->item, ys);
 }
 
+// How many cells the batched helpers allocate or free per call. They are
+// inline so programs that stick to the plain helpers do not warn.
+#define LIST_BATCH 64
+
+// free_list, handing cells back LIST_BATCH at a time.
+static inline
+void
+free_list_batch(cell* xs)
+{
+    void* ptrs[LIST_BATCH];
+    size_t nn = 0;
+
+    while (xs) {
+        ptrs[nn++] = xs;
+        xs = xs->rest;
+
+        if (nn == LIST_BATCH || xs == 0) {
+            xfree_batch(ptrs, nn);
+            nn = 0;
+        }
+    }
+}
+
+// copy_list, allocating cells LIST_BATCH at a time. Returns 0 if memory
+// runs out, having freed the partial copy.
+static inline
+cell*
+copy_list_batch(cell* xs)
+{
+    void* cells[LIST_BATCH];
+    cell* ys = 0;
+    cell** tail = &ys;
+
+    while (xs) {
+        size_t want = 0;
+        for (cell* zs = xs; zs && want < LIST_BATCH; zs = zs->rest) {
+            want++;
+        }
+
+        size_t got = xmalloc_batch(sizeof(cell), want, cells);
+        for (size_t ii = 0; ii < got; ii++) {
+            cell* cc = cells[ii];
+            cc->item = xs->item;
+            cc->rest = 0;
+            *tail = cc;
+            tail = &cc->rest;
+            xs = xs->rest;
+        }
+
+        if (got < want) {
+            free_list_batch(ys);
+            return 0;
+        }
+    }
+
+    return ys;
+}
+
+// cons and copy_list taking their cells from an arena, for lists that
+// are dropped all at once with xarena_reset() instead of free_list.
+static inline
+cell*
+arena_cons(xarena_t* ar, long item, cell* rest)
+{
+    cell* xs = xarena_alloc(ar, sizeof(cell));
+    xs->item = item;
+    xs->rest = rest;
+    return xs;
+}
+
+static inline
+cell*
+arena_copy_list(xarena_t* ar, cell* xs)
+{
+    cell* ys = 0;
+    cell** tail = &ys;
+
+    while (xs) {
+        *tail = arena_cons(ar, xs->item, 0);
+        tail = &(*tail)->rest;
+        xs = xs->rest;
+    }
+
+    return ys;
+}
+
+// cons, free_list and copy_list on a pool of cells, made with
+// xpool_create(sizeof(cell), _Alignof(cell), 0).
+static inline
+cell*
+pool_cons(xpool_t* pool, long item, cell* rest)
+{
+    cell* xs = xpool_alloc(pool);
+    xs->item = item;
+    xs->rest = rest;
+    return xs;
+}
+
+static inline
+void
+pool_free_list(xpool_t* pool, cell* xs)
+{
+    while (xs) {
+        cell* ys = xs->rest;
+        xpool_free(pool, xs);
+        xs = ys;
+    }
+}
+
+static inline
+cell*
+pool_copy_list(xpool_t* pool, cell* xs)
+{
+    cell* ys = 0;
+    cell** tail = &ys;
+
+    while (xs) {
+        *tail = pool_cons(pool, xs->item, 0);
+        tail = &(*tail)->rest;
+        xs = xs->rest;
+    }
+
+    return ys;
+}
+
 #endif
 
@@ -1,40 +1,166 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/mman.h>
 #include <stdint.h>
 #include <pthread.h>
 #include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <sched.h>
+#include <sys/sysinfo.h>
+#if defined(__x86_64__) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define HAVE_RSEQ 1
+#endif
 
 #include "xmalloc.h"
+#include "pages.h"
+#include "reclaim.h"
+#include "stats.h"
 
-// Used whether free or in use
-// if in use, next and prev of surrounding entries will skip one in use
+// A free small slot. Small objects carry no header: their size class comes
+// from the slab they sit in, found through the span map below, so a slot
+// only holds a link while it is cached.
 typedef struct chunk {
-	size_t size;
-	//struct chunk* prev;
 	struct chunk* next;
 } chunk;
 
+// Large blocks get a mapping of their own with this header right in front
+// of the payload. The payload normally starts sizeof(big) into the
+// mapping, further in for aligned blocks.
+typedef struct big {
+	size_t size;          // bytes asked for plus offset
+	size_t offset;        // payload start minus mapping start
+} big;
+
+// Small chunks are carved out of slabs: SLAB_SIZE-aligned runs of pages
+// that each hold a single size class. A set bit in bitmap is a free slot,
+// so handing out or taking back a slot never walks a list. Slots go
+// lowest first, so the ones ever handed out are always those below fresh;
+// in a slab whose pages came zero, the rest still are.
+#define SLAB_SHIFT 16
+#define SLAB_SIZE (1 << SLAB_SHIFT)
+#define SLAB_WORDS (SLAB_SIZE / 16 / 64)
+
+typedef struct slab {
+	struct slab* next;    // links between partially free slabs of a bucket
+	struct slab* prev;
+	struct theap* owner;  // thread whose cache last took slots from here
+	long b_idx;
+	long nfree;
+	long nslots;
+	size_t first;         // offset of slot 0 from the slab base
+	long fresh;           // first slot never handed out, nslots if dirty
+	uint64_t bitmap[SLAB_WORDS];
+} slab;
+
 long NUM_BUCKETS = 19;
-chunk* buckets[19];    // initially all NULL since global
+slab* buckets[19];    // slabs with at least one free slot, initially all NULL
 size_t bucket_sizes[] = {8, 12, 16, 24, 32, 48, 64, 96, 128, 192,
 						 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096};
 
+// Slot bytes in every slab of a bucket, for xmalloc_stats(). Guarded by
+// mutex.
+static size_t slab_bytes[19];
+
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 const size_t PAGE_SIZE = 4096;
 const size_t MIN_ALLOCATION = 8;
 
+// A thread's mailbox for chunks other threads free into slabs it owns.
+// Other threads push with a CAS, the owner takes the whole list at once at
+// its next refill, so neither side locks. A theap outlives its thread:
+// slabs may still name it as owner, so on exit it is marked dead and
+// handed to the next thread that starts.
+typedef struct theap {
+	chunk* remote;        // lock-free MPSC stack of remotely freed chunks
+	int alive;
+	long frees;           // counted by the owning thread only
+	long remote_frees;    // frees it sent to another thread's mailbox
+	struct theap* next;   // every theap ever made, guarded by mutex
+} theap;
+
+static theap* heaps = NULL;
+
+// Per-thread cache in front of buckets[]. Hits and frees only touch this,
+// refills and flushes move chunks to and from the slabs in batches.
+// Chunks carved from the fresh part of a slab are kept apart: they are
+// zero but for their link, which is all xcalloc() has to clear.
+typedef struct tcache {
+	chunk* head[19];
+	long count[19];
+	chunk* fresh[19];
+	theap* heap;
+} tcache;
+
+// Between the thread caches and the slabs sits a depot per bucket: a
+// lock-free stack of full batches, cache_batch() chunks each, chained
+// through chunk->next. The first chunk of a batch links to the next batch
+// in the word after its own link. The stack top packs a 16-bit generation
+// tag above the 48-bit pointer so a pop that raced with pop-push of the
+// same batch fails its CAS instead of corrupting the stack (ABA).
+typedef struct batch {
+	chunk head;
+	struct batch* link;
+} batch;
+
+#define DEPOT_TAG_SHIFT 48
+#define DEPOT_MAX 32      // batches per bucket before flushes go to the slabs
+
+static uint64_t depot[19];
+static long depot_count[19];
+
+static __thread tcache tc;
+static __thread int tc_registered = 0;
+static pthread_key_t tc_key;
+static pthread_once_t tc_once = PTHREAD_ONCE_INIT;
+
+// With XMALLOC_PERCPU=1 the fast path uses one cache per CPU instead of
+// per thread, so cached memory is bounded by the core count no matter how
+// many threads run. Each per-CPU list is a stack whose nodes record their
+// depth in the word after their link, so a push knows when the list is full
+// without a separate counter. Pushes and pops run as restartable sequences
+// (rseq) that commit with a single store; without rseq they fall back to
+// sched_getcpu() and a per-CPU lock.
+typedef struct pchunk {
+	chunk head;
+	long depth;
+} pchunk;
+
+typedef struct pcpu {
+	chunk* head[19];
+	pthread_mutex_t lock;
+} pcpu;
+
+static pcpu* pcs = NULL;     // NULL unless per-CPU mode is on
+static long ncpus = 0;
+static int use_rseq = 0;
+
+// Span map: which SLAB_SIZE spans of the address space are slabs. A
+// two-level radix tree over the span number of a 48-bit address with a
+// byte per span; leaves are mapped on first use and never freed, so
+// lookups need no lock. A pointer whose span is not in the map is a large
+// block.
+#define SPAN_LEAF_BITS 16
+#define SPAN_LEAF (1 << SPAN_LEAF_BITS)
+
+static unsigned char* span_root[1 << (48 - SLAB_SHIFT - SPAN_LEAF_BITS)];
+
+// The smallest bucket that fits size. Above 16 the sizes alternate
+// 2^k, 3 * 2^(k-1), so the bucket follows from the top two bits of
+// size - 1. This needs no table and so works before any constructor has
+// run. A chunk parked in the depot needs room for a batch link after its
+// own link, so the buckets under 16 bytes are never used.
 long
 bucket(size_t size)
 {
-	long b_idx = 0;
-	size_t minSize = bucket_sizes[b_idx];
+	if (size <= 16)
+		return 2;
 
-	while (minSize < size) {
-		if (b_idx < NUM_BUCKETS)
-			minSize = bucket_sizes[++b_idx];
-	}
+	size_t nn = size - 1;
+	long hb = 63 - __builtin_clzl(nn);
 
-	return b_idx;
+	return 2 * (hb - 3) + 1 + ((nn >> (hb - 1)) & 1);
 }
 
 static
@@ -50,242 +176,1276 @@ div_up(size_t xx, size_t yy)
 
 }
 
-long
-bucket_add(void* addr, long b_idx)
+static
+void
+bucket_link(slab* sb)
 {
-	chunk* toAdd = (chunk*)(addr);
-	chunk* tmp = buckets[b_idx];
-	chunk* tmp_prev = NULL;
-	long insIdx = 0;
+	sb->prev = NULL;
+	sb->next = buckets[sb->b_idx];
+	if (sb->next)
+		sb->next->prev = sb;
+	buckets[sb->b_idx] = sb;
+}
 
-	if (tmp && (uintptr_t)tmp < (uintptr_t)addr) {
+static
+void
+bucket_unlink(slab* sb)
+{
+	if (sb->prev)
+		sb->prev->next = sb->next;
+	else
+		buckets[sb->b_idx] = sb->next;
 
-		while (tmp && (uintptr_t)tmp < (uintptr_t)addr) {
-			tmp_prev = tmp;
-			tmp = tmp->next;
-			insIdx += 1;
-		}
+	if (sb->next)
+		sb->next->prev = sb->prev;
+}
 
-		toAdd->size = bucket_sizes[b_idx];
-		toAdd->next = tmp;
-		if (tmp_prev)
-			tmp_prev->next = toAdd;
+static
+slab*
+slab_of(chunk* cPtr)
+{
+	return (slab*)((uintptr_t)cPtr & ~((uintptr_t)SLAB_SIZE - 1));
+}
+
+static
+slab*
+span_lookup(void* ptr)
+{
+	uintptr_t span = (uintptr_t)ptr >> SLAB_SHIFT;
+
+	if (span >> SPAN_LEAF_BITS >= sizeof(span_root) / sizeof(span_root[0]))
+		return NULL;
+
+	unsigned char* leaf = __atomic_load_n(&span_root[span >> SPAN_LEAF_BITS], __ATOMIC_ACQUIRE);
+	if (!leaf || !__atomic_load_n(&leaf[span & (SPAN_LEAF - 1)], __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return slab_of((chunk*)ptr);
+}
+
+// Must hold mutex.
+static
+int
+span_register(slab* sb)
+{
+	uintptr_t span = (uintptr_t)sb >> SLAB_SHIFT;
+	unsigned char* leaf = span_root[span >> SPAN_LEAF_BITS];
+
+	if (!leaf) {
+		leaf = pages_map(SPAN_LEAF);
+		if (!leaf)
+			return 0;
+		__atomic_store_n(&span_root[span >> SPAN_LEAF_BITS], leaf, __ATOMIC_RELEASE);
 	}
-	else {
-		toAdd->size = bucket_sizes[b_idx];
-		toAdd->next = buckets[b_idx];
-		buckets[b_idx] = toAdd;
+
+	__atomic_store_n(&leaf[span & (SPAN_LEAF - 1)], 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+// Must hold mutex.
+static
+void
+span_unregister(slab* sb)
+{
+	uintptr_t span = (uintptr_t)sb >> SLAB_SHIFT;
+	__atomic_store_n(&span_root[span >> SPAN_LEAF_BITS][span & (SPAN_LEAF - 1)], 0, __ATOMIC_RELEASE);
+}
+
+// Take a fresh slab for b_idx from the page source. Must hold mutex.
+static
+slab*
+slab_create(long b_idx)
+{
+	int clean;
+	void* base = pages_alloc_clean(SLAB_SIZE, SLAB_SIZE, &clean);
+	if (!base)
+		return NULL;
+
+	if (!span_register((slab*)base)) {
+		pages_free(base, SLAB_SIZE);
+		return NULL;
+	}
+
+	slab* sb = (slab*)base;
+	memset(sb, 0, sizeof(slab));
+	sb->b_idx = b_idx;
+	// Line slots up on the largest power of two dividing their size (at
+	// most a page), so power-of-two buckets are naturally aligned. The
+	// padding never costs a slot.
+	size_t align = bucket_sizes[b_idx] & -bucket_sizes[b_idx];
+	if (align < 16)
+		align = 16;
+	sb->first = (sizeof(slab) + align - 1) & ~(align - 1);
+	sb->nslots = (SLAB_SIZE - sb->first) / bucket_sizes[b_idx];
+	sb->nfree = sb->nslots;
+	sb->fresh = clean ? 0 : sb->nslots;
+	slab_bytes[b_idx] += sb->nslots * bucket_sizes[b_idx];
+
+	for (long i = 0; i < sb->nslots; i++)
+		sb->bitmap[i / 64] |= (uint64_t)1 << (i % 64);
+
+	bucket_link(sb);
+	return sb;
+}
+
+// Take the lowest free slot of sb, setting *fresh (if fresh is not NULL)
+// when it is still zero. Must hold mutex.
+static
+chunk*
+slab_take(slab* sb, int* fresh)
+{
+	long w = 0;
+	while (!sb->bitmap[w])
+		w += 1;
+
+	long bit = __builtin_ctzll(sb->bitmap[w]);
+	sb->bitmap[w] &= ~((uint64_t)1 << bit);
+
+	sb->nfree -= 1;
+	if (sb->nfree == 0)
+		bucket_unlink(sb);
+
+	__atomic_store_n(&sb->owner, tc.heap, __ATOMIC_RELAXED);
+
+	long idx = w * 64 + bit;
+	if (fresh)
+		*fresh = idx >= sb->fresh;
+	if (idx >= sb->fresh)
+		sb->fresh = idx + 1;
+
+	return (chunk*)((void*)sb + sb->first + idx * bucket_sizes[sb->b_idx]);
+}
+
+// Give a slab with every slot free back to the page source, which
+// purges it once it has been idle long enough. Must hold mutex.
+static
+void
+slab_release(slab* sb)
+{
+	bucket_unlink(sb);
+	span_unregister(sb);
+	slab_bytes[sb->b_idx] -= sb->nslots * bucket_sizes[sb->b_idx];
+	pages_free(sb, SLAB_SIZE);
+}
+
+// Hand a slot back to the slab it came from. A slab that empties is
+// released unless it is the last one of its bucket with free slots, so
+// a single object allocated and freed over and over does not map and
+// release a slab each time. Must hold mutex.
+static
+void
+slab_give(chunk* cPtr)
+{
+	slab* sb = slab_of(cPtr);
+	long idx = ((void*)cPtr - ((void*)sb + sb->first)) / bucket_sizes[sb->b_idx];
+
+	sb->bitmap[idx / 64] |= (uint64_t)1 << (idx % 64);
+
+	if (sb->nfree == 0)
+		bucket_link(sb);
+	sb->nfree += 1;
+
+	if (sb->nfree == sb->nslots && (sb->prev || sb->next))
+		slab_release(sb);
+}
+
+// How many chunks of a class move between a thread cache and the depot or
+// the slabs at once.
+static
+long
+cache_batch(long b_idx)
+{
+	long nn = (4 * PAGE_SIZE) / bucket_sizes[b_idx];
+
+	if (nn < 4)
+		return 4;
+	if (nn > 64)
+		return 64;
+	return nn;
+}
+
+static
+void
+cache_flush(long b_idx, long nn)
+{
+	xstats_lock(&mutex);
+	while (nn-- && tc.head[b_idx]) {
+		chunk* tmp = tc.head[b_idx];
+		tc.head[b_idx] = tmp->next;
+		tc.count[b_idx] -= 1;
+		slab_give(tmp);
 	}
+	pthread_mutex_unlock(&mutex);
+}
 
-	return insIdx;
+// Give this thread's fresh chunks of b_idx back to their slabs, where
+// they count as used from then on.
+static
+void
+fresh_flush(long b_idx)
+{
+	xstats_lock(&mutex);
+	while (tc.fresh[b_idx]) {
+		chunk* tmp = tc.fresh[b_idx];
+		tc.fresh[b_idx] = tmp->next;
+		slab_give(tmp);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+static
+batch*
+depot_ptr(uint64_t top)
+{
+	return (batch*)(top & (((uint64_t)1 << DEPOT_TAG_SHIFT) - 1));
+}
+
+static
+uint64_t
+depot_pack(batch* bt, uint64_t old)
+{
+	uint64_t tag = (old >> DEPOT_TAG_SHIFT) + 1;
+	return (tag << DEPOT_TAG_SHIFT) | (uint64_t)bt;
 }
 
+static
 void
-bucket_delete(long b_idx, long idx)
+depot_push(long b_idx, batch* bt)
 {
-	chunk* tmp = buckets[b_idx];
+	uint64_t top = __atomic_load_n(&depot[b_idx], __ATOMIC_RELAXED);
 
-	printf("idx: %ld\n", idx);
-	if (idx == 0) {
-		if (tmp)
-			buckets[b_idx] = tmp->next;
+	do {
+		bt->link = depot_ptr(top);
+	} while (!__atomic_compare_exchange_n(&depot[b_idx], &top, depot_pack(bt, top), 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
 
+	__atomic_add_fetch(&depot_count[b_idx], 1, __ATOMIC_RELAXED);
+}
+
+// Reading bt->link may see a batch another thread already popped and
+// reused, but then the tag has moved on and the CAS fails. Slab memory is
+// never unmapped, so the read itself is safe.
+static
+batch*
+depot_pop(long b_idx)
+{
+	uint64_t top = __atomic_load_n(&depot[b_idx], __ATOMIC_ACQUIRE);
+	batch* bt;
+
+	do {
+		bt = depot_ptr(top);
+		if (!bt)
+			return NULL;
+	} while (!__atomic_compare_exchange_n(&depot[b_idx], &top, depot_pack(bt->link, top), 1,
+				__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+	__atomic_sub_fetch(&depot_count[b_idx], 1, __ATOMIC_RELAXED);
+	return bt;
+}
+
+// Hand one batch from the cache to the depot, or to the slabs once the
+// depot is holding enough of this bucket.
+static
+void
+cache_release(long b_idx)
+{
+	long nn = cache_batch(b_idx);
+
+	if (__atomic_load_n(&depot_count[b_idx], __ATOMIC_RELAXED) >= DEPOT_MAX) {
+		cache_flush(b_idx, nn);
 		return;
 	}
 
-	while (--idx)
-		tmp = tmp->next;
+	chunk* first = tc.head[b_idx];
+	chunk* last = first;
+	for (long i = 1; i < nn; i++)
+		last = last->next;
+
+	tc.head[b_idx] = last->next;
+	tc.count[b_idx] -= nn;
+	last->next = NULL;
 
-	if (tmp && tmp->next)
-		tmp->next = tmp->next->next;
+	depot_push(b_idx, (batch*)first);
 }
 
+static
 void
-bucket_coalesce()
+remote_push(theap* heap, chunk* cPtr)
 {
-	chunk* tmp = NULL;
-	chunk* tmp_prev = NULL;
-	char del = 0;
-	long idx = 0;
+	chunk* head = __atomic_load_n(&heap->remote, __ATOMIC_RELAXED);
 
-	for (int i = 0; i < NUM_BUCKETS; i++) {
+	do {
+		cPtr->next = head;
+	} while (!__atomic_compare_exchange_n(&heap->remote, &head, cPtr, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
 
-		do {
+// Move everything other threads freed to us into our cache. Taking the
+// whole list with one exchange sidesteps ABA. A busy mailbox can hold far
+// more than the cache bound, so any class pushed past 2 * cache_batch
+// passes the surplus on to the depot or the slabs in whole batches.
+static
+void
+remote_take()
+{
+	chunk* tmp = __atomic_exchange_n(&tc.heap->remote, NULL, __ATOMIC_ACQUIRE);
+	uint64_t touched = 0;
+
+	while (tmp) {
+		chunk* next = tmp->next;
+		long b_idx = slab_of(tmp)->b_idx;
+
+		tmp->next = tc.head[b_idx];
+		tc.head[b_idx] = tmp;
+		tc.count[b_idx] += 1;
+		touched |= (uint64_t)1 << b_idx;
+		tmp = next;
+	}
 
-			tmp = buckets[i];
-			tmp_prev = NULL;
-			idx = 0;
+	for (long i = 0; touched; i++, touched >>= 1) {
+		while ((touched & 1) && tc.count[i] > 2 * cache_batch(i))
+			cache_release(i);
+	}
+}
 
-			del = 0;
+// Runs when a thread exits, handing everything it cached back to the slabs.
+// Frees that race with this land in the dead theap's mailbox and are
+// picked up by the next thread to adopt it.
+static
+void
+cache_drain(void* _arg)
+{
+	__atomic_store_n(&tc.heap->alive, 0, __ATOMIC_RELEASE);
+	remote_take();
 
-			while (tmp) {
+	for (long i = 0; i < NUM_BUCKETS; i++) {
+		cache_flush(i, tc.count[i]);
+		fresh_flush(i);
+	}
+}
 
-				if (i < NUM_BUCKETS - 1 && tmp_prev && (uintptr_t)(tmp_prev) + tmp_prev->size == (uintptr_t)(tmp)) {
-					bucket_delete(i, idx); // remove tmp_prev and tmp from lower list
-					bucket_delete(i, idx - 1);
-					bucket_add((void*)tmp_prev, i + 1); // add tmp_prev to next list up
+static
+void
+heap_report()
+{
+	long frees = 0;
+	long remote = 0;
 
-					idx -= 1;
-					del = 1;
-				}
+	xstats_lock(&mutex);
+	for (theap* heap = heaps; heap; heap = heap->next) {
+		frees += heap->frees;
+		remote += heap->remote_frees;
+	}
+	pthread_mutex_unlock(&mutex);
 
-				idx += 1;
-				tmp_prev = tmp;
-				tmp = tmp->next;
-			} // end while
+	fprintf(stderr, "xmalloc: %ld small frees, %ld remote\n", frees, remote);
+}
 
-		} while (del == 1);
+static
+void
+cache_key_init()
+{
+	pthread_key_create(&tc_key, cache_drain);
 
-	} // end for
+	if (getenv("XMALLOC_STATS"))
+		atexit(heap_report);
+}
 
-} // end bucket_coalesce
+// Reuse a dead theap, or make a page worth of new ones. Must hold mutex.
+static
+theap*
+heap_acquire()
+{
+	for (theap* heap = heaps; heap; heap = heap->next) {
+		if (!__atomic_load_n(&heap->alive, __ATOMIC_ACQUIRE))
+			return heap;
+	}
 
-void*
-xmalloc(size_t bytes)
+	theap* page = pages_alloc(PAGE_SIZE, PAGE_SIZE);
+	if (!page)
+		return NULL;
+
+	memset(page, 0, PAGE_SIZE);
+	for (long i = PAGE_SIZE / sizeof(theap) - 1; i >= 0; i--) {
+		page[i].next = heaps;
+		heaps = &page[i];
+	}
+
+	return heaps;
+}
+
+static
+int
+cache_register()
 {
-	bytes += sizeof(chunk);
+	pthread_once(&tc_once, cache_key_init);
 
-	void* ptr = NULL;
+	xstats_lock(&mutex);
+	tc.heap = heap_acquire();
+	if (tc.heap)
+		__atomic_store_n(&tc.heap->alive, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&mutex);
+
+	if (!tc.heap)
+		return 0;
+
+	pthread_setspecific(tc_key, &tc);
+	tc_registered = 1;
+	return 1;
+}
 
-	if (bytes <= PAGE_SIZE) {
-		pthread_mutex_lock(&mutex);
+static
+int
+cache_refill(long b_idx)
+{
+	long nn = cache_batch(b_idx);
+
+	if (__atomic_load_n(&tc.heap->remote, __ATOMIC_RELAXED)) {
+		remote_take();
+		if (tc.head[b_idx])
+			return 1;
+	}
+
+	batch* bt = depot_pop(b_idx);
+	if (bt) {
+		chunk* last = &bt->head;
+		while (last->next)
+			last = last->next;
+
+		last->next = tc.head[b_idx];
+		tc.head[b_idx] = &bt->head;
+		tc.count[b_idx] += nn;
+		return 1;
+	}
 
-		long b_idx = bucket(bytes);
-		chunk* tmp = buckets[b_idx];
+	// With frees deferred, reclaim them before carving new slabs.
+	if (reclaim_on && !buckets[b_idx]) {
+		reclaim_drain();
+		if (tc.head[b_idx])
+			return 1;
+	}
 
-		if (tmp) {
-			ptr = (void*)(tmp); // header filled out when added to list
-			bucket_delete(b_idx, 0);
+	xstats_lock(&mutex);
+	while (nn--) {
+		if (!buckets[b_idx] && !slab_create(b_idx))
+			break;
+
+		int fresh;
+		chunk* tmp = slab_take(buckets[b_idx], &fresh);
+		if (fresh) {
+			tmp->next = tc.fresh[b_idx];
+			tc.fresh[b_idx] = tmp;
+			continue;
 		}
-		// No entry of that size in list, so look for available larger chunks to split
-		else {
 
-			// get b_idx to first list with available chunks
-			long off = 0;
-			while (!buckets[b_idx + off]) {
+		tmp->next = tc.head[b_idx];
+		tc.head[b_idx] = tmp;
+		tc.count[b_idx] += 1;
+	}
+	pthread_mutex_unlock(&mutex);
 
-				if (b_idx + off == NUM_BUCKETS - 1) {
-					ptr = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-					bucket_add(ptr, b_idx + off);
-					break;
-				}
+	return tc.head[b_idx] || tc.fresh[b_idx];
+}
 
-				off += 1;
-			}
+// Take up to nn chunks of b_idx from the depot, or carve them out of the
+// slabs, as a NULL-terminated list.
+static
+chunk*
+batch_take(long b_idx, long nn)
+{
+	batch* bt = depot_pop(b_idx);
+	if (bt)
+		return &bt->head;
 
-			// Let memory flow down buckets
-			ptr = (void*)buckets[b_idx + off];
-			bucket_delete(b_idx + off, 0);
+	if (reclaim_on && !buckets[b_idx])
+		reclaim_drain();
 
-			while (off) {
-				void* split = (void*)((uintptr_t)ptr + bucket_sizes[b_idx + --off]);
-				long bkt = bucket(bucket_sizes[b_idx + off + 1] - bucket_sizes[b_idx + off]);
-				bucket_add(split, bkt);
-			}
+	chunk* list = NULL;
 
-			bucket_add(ptr, b_idx);
+	xstats_lock(&mutex);
+	while (nn--) {
+		if (!buckets[b_idx] && !slab_create(b_idx))
+			break;
 
-			pthread_mutex_unlock(&mutex);
-			return xmalloc(bytes - sizeof(chunk));
-		}
+		chunk* tmp = slab_take(buckets[b_idx], NULL);
+		tmp->next = list;
+		list = tmp;
+	}
+	pthread_mutex_unlock(&mutex);
+
+	return list;
+}
 
-		pthread_mutex_unlock(&mutex);	
+// Give a list of nn chunks of b_idx to the depot if it is a full batch
+// and the depot has room, otherwise straight back to the slabs.
+static
+void
+batch_give(long b_idx, chunk* list, long nn)
+{
+	if (nn == cache_batch(b_idx) && __atomic_load_n(&depot_count[b_idx], __ATOMIC_RELAXED) < DEPOT_MAX) {
+		depot_push(b_idx, (batch*)list);
+		return;
 	}
-	else {
-		size_t pages = div_up(bytes, PAGE_SIZE);
 
-		ptr = mmap(NULL, pages * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-		if (ptr == (void*)(-1))
-			perror("xmalloc: mmap() failed");
+	xstats_lock(&mutex);
+	while (list) {
+		chunk* next = list->next;
+		slab_give(list);
+		list = next;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+#ifdef HAVE_RSEQ
+static
+struct rseq*
+rseq_area()
+{
+	return (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+}
+
+// Pop the head of this CPU's list for the bucket at base. If the thread
+// is preempted or migrates before the commit store, the kernel sends it
+// to the abort handler, which starts over on whatever CPU it is now on.
+static
+chunk*
+rseq_pop(chunk** base)
+{
+	chunk* res;
+
+	__asm__ __volatile__(
+		"0:\n\t"
+		"leaq 3f(%%rip), %%rax\n\t"
+		"movq %%rax, %c[cs_off](%[rs])\n\t"
+		"1:\n\t"
+		"movl %c[cpu_off](%[rs]), %%eax\n\t"
+		"imulq %[stride], %%rax\n\t"
+		"addq %[base], %%rax\n\t"
+		"movq (%%rax), %[res]\n\t"
+		"testq %[res], %[res]\n\t"
+		"jz 2f\n\t"
+		"movq %c[next_off](%[res]), %%rcx\n\t"
+		"movq %%rcx, (%%rax)\n\t"          // commit
+		"2:\n\t"
+		".pushsection __rseq_cs, \"aw\"\n\t"
+		".balign 32\n\t"
+		"3: .long 0, 0\n\t"
+		".quad 1b, 2b - 1b, 4f\n\t"
+		".popsection\n\t"
+		".pushsection __rseq_failure, \"ax\"\n\t"
+		".byte 0x0f, 0xb9, 0x3d\n\t"
+		".long %c[sig]\n\t"
+		"4: jmp 0b\n\t"
+		".popsection\n\t"
+		: [res] "=&r" (res)
+		: [rs] "r" (rseq_area()), [base] "r" (base), [stride] "r" ((long)sizeof(pcpu)),
+		  [cs_off] "i" (offsetof(struct rseq, rseq_cs)),
+		  [cpu_off] "i" (offsetof(struct rseq, cpu_id)),
+		  [next_off] "i" (offsetof(chunk, next)),
+		  [sig] "i" (RSEQ_SIG)
+		: "rax", "rcx", "memory", "cc");
+
+	return res;
+}
+
+// Push node onto this CPU's list unless that would make it deeper than
+// max. Returns 0 if the list was full.
+static
+int
+rseq_push(chunk** base, chunk* node, long max)
+{
+	long ok = 0;
+
+	__asm__ __volatile__(
+		"0:\n\t"
+		"leaq 3f(%%rip), %%rax\n\t"
+		"movq %%rax, %c[cs_off](%[rs])\n\t"
+		"1:\n\t"
+		"movl %c[cpu_off](%[rs]), %%eax\n\t"
+		"imulq %[stride], %%rax\n\t"
+		"addq %[base], %%rax\n\t"
+		"movq (%%rax), %%rcx\n\t"
+		"xorl %%edx, %%edx\n\t"
+		"testq %%rcx, %%rcx\n\t"
+		"jz 5f\n\t"
+		"movq %c[depth_off](%%rcx), %%rdx\n\t"
+		"5:\n\t"
+		"addq $1, %%rdx\n\t"
+		"cmpq %[max], %%rdx\n\t"
+		"ja 6f\n\t"
+		"movq %%rcx, %c[next_off](%[node])\n\t"
+		"movq %%rdx, %c[depth_off](%[node])\n\t"
+		"movq %[node], (%%rax)\n\t"        // commit
+		"2:\n\t"
+		"movq $1, %[ok]\n\t"
+		"6:\n\t"
+		".pushsection __rseq_cs, \"aw\"\n\t"
+		".balign 32\n\t"
+		"3: .long 0, 0\n\t"
+		".quad 1b, 2b - 1b, 4f\n\t"
+		".popsection\n\t"
+		".pushsection __rseq_failure, \"ax\"\n\t"
+		".byte 0x0f, 0xb9, 0x3d\n\t"
+		".long %c[sig]\n\t"
+		"4: jmp 0b\n\t"
+		".popsection\n\t"
+		: [ok] "+r" (ok)
+		: [rs] "r" (rseq_area()), [base] "r" (base), [stride] "r" ((long)sizeof(pcpu)),
+		  [node] "r" (node), [max] "r" (max),
+		  [cs_off] "i" (offsetof(struct rseq, rseq_cs)),
+		  [cpu_off] "i" (offsetof(struct rseq, cpu_id)),
+		  [next_off] "i" (offsetof(chunk, next)),
+		  [depth_off] "i" (offsetof(pchunk, depth)),
+		  [sig] "i" (RSEQ_SIG)
+		: "rax", "rcx", "rdx", "memory", "cc");
+
+	return ok;
+}
+#endif
+
+static
+pcpu*
+percpu_lock()
+{
+	int cpu = sched_getcpu();
+	pcpu* pc = &pcs[(cpu < 0 ? 0 : cpu) % ncpus];
+
+	xstats_lock(&pc->lock);
+	return pc;
+}
+
+static
+chunk*
+percpu_pop(long b_idx)
+{
+#ifdef HAVE_RSEQ
+	if (use_rseq)
+		return rseq_pop(&pcs[0].head[b_idx]);
+#endif
+
+	pcpu* pc = percpu_lock();
+	chunk* cPtr = pc->head[b_idx];
+	if (cPtr)
+		pc->head[b_idx] = cPtr->next;
+	pthread_mutex_unlock(&pc->lock);
+
+	return cPtr;
+}
+
+static
+int
+percpu_push(long b_idx, chunk* cPtr)
+{
+	long max = 2 * cache_batch(b_idx);
+
+#ifdef HAVE_RSEQ
+	if (use_rseq)
+		return rseq_push(&pcs[0].head[b_idx], cPtr, max);
+#endif
+
+	pcpu* pc = percpu_lock();
+	chunk* head = pc->head[b_idx];
+	long depth = head ? ((pchunk*)head)->depth + 1 : 1;
+
+	if (depth <= max) {
+		cPtr->next = head;
+		((pchunk*)cPtr)->depth = depth;
+		pc->head[b_idx] = cPtr;
+	}
+	pthread_mutex_unlock(&pc->lock);
+
+	return depth <= max;
+}
 
-		chunk* cPtr = (chunk*)(ptr);
-		cPtr->size = bytes;
-		cPtr->next = NULL;
+static
+chunk*
+percpu_alloc(long b_idx)
+{
+	chunk* cPtr = percpu_pop(b_idx);
+	if (cPtr)
+		return cPtr;
+
+	chunk* list = batch_take(b_idx, cache_batch(b_idx));
+	if (!list)
+		return NULL;
+
+	cPtr = list;
+	list = list->next;
+
+	while (list) {
+		chunk* next = list->next;
+		if (!percpu_push(b_idx, list)) {
+			long nn = 0;
+			for (chunk* tmp = list; tmp; tmp = tmp->next)
+				nn += 1;
+			batch_give(b_idx, list, nn);
+			break;
+		}
+		list = next;
 	}
 
-	return ptr + sizeof(chunk);
+	return cPtr;
 }
 
+// A full per-CPU list sheds a batch to the depot before taking cPtr.
+static
 void
-xfree(void* ptr)
+percpu_free(long b_idx, chunk* cPtr)
 {
-	chunk* cPtr = (chunk*)(ptr - sizeof(chunk));
-	size_t size = cPtr->size;
-	
-	if (size <= PAGE_SIZE) {
-		long b_idx = bucket(cPtr->size);
+	if (percpu_push(b_idx, cPtr))
+		return;
+
+	chunk* list = NULL;
+	long nn = 0;
 
-		pthread_mutex_lock(&mutex);
-		bucket_add((void*)cPtr, b_idx);
-		bucket_coalesce();
+	while (nn < cache_batch(b_idx)) {
+		chunk* tmp = percpu_pop(b_idx);
+		if (!tmp)
+			break;
+
+		tmp->next = list;
+		list = tmp;
+		nn += 1;
+	}
+
+	if (list)
+		batch_give(b_idx, list, nn);
+
+	if (!percpu_push(b_idx, cPtr)) {
+		xstats_lock(&mutex);
+		slab_give(cPtr);
 		pthread_mutex_unlock(&mutex);
 	}
+}
+
+static
+void
+percpu_report()
+{
+	fprintf(stderr, "xmalloc: per-CPU caches on %ld CPUs using %s\n",
+			ncpus, use_rseq ? "rseq" : "sched_getcpu and locks");
+}
+
+__attribute__((constructor))
+static
+void
+percpu_init()
+{
+	char* env = getenv("XMALLOC_PERCPU");
+	if (!env || atol(env) <= 0)
+		return;
+
+	ncpus = get_nprocs_conf();
+	if (ncpus < 1)
+		ncpus = 1;
+
+	size_t bytes = div_up(ncpus * sizeof(pcpu), PAGE_SIZE) * PAGE_SIZE;
+	pcpu* pp = pages_alloc(bytes, PAGE_SIZE);
+	if (!pp)
+		return;
+
+	memset(pp, 0, bytes);
+	for (long i = 0; i < ncpus; i++)
+		pthread_mutex_init(&pp[i].lock, NULL);
+
+#ifdef HAVE_RSEQ
+	// glibc registers every thread with the kernel unless told not to;
+	// cpu_id reads as negative in threads it has not registered.
+	use_rseq = __rseq_size > 0 && (int)rseq_area()->cpu_id >= 0 && rseq_area()->cpu_id < ncpus;
+#endif
+
+	pcs = pp;
+
+	if (getenv("XMALLOC_STATS"))
+		atexit(percpu_report);
+}
+
+// Take a chunk of b_idx. Recycled chunks go first unless clean is not
+// NULL, in which case fresh ones do and *clean says which it got.
+static
+void*
+small_alloc(long b_idx, int* clean)
+{
+	if (clean)
+		*clean = 0;
+
+	if (pcs) {
+		void* ptr = percpu_alloc(b_idx);
+		if (ptr)
+			xstats_alloc(b_idx, bucket_sizes[b_idx]);
+		return ptr;
+	}
+
+	if (!tc_registered && !cache_register())
+		return NULL;
+
+	if (!tc.head[b_idx] && !tc.fresh[b_idx] && !cache_refill(b_idx))
+		return NULL;
+
+	chunk* tmp = tc.head[b_idx];
+	if (tc.fresh[b_idx] && (clean || !tmp)) {
+		tmp = tc.fresh[b_idx];
+		tc.fresh[b_idx] = tmp->next;
+		if (clean)
+			*clean = 1;
+	}
 	else {
-		int err = munmap(cPtr, size);
-		if (err == -1)
-			perror("xfree: munmap() failed");
+		tc.head[b_idx] = tmp->next;
+		tc.count[b_idx] -= 1;
 	}
+	xstats_alloc(b_idx, bucket_sizes[b_idx]);
+
+	return (void*)(tmp);
+}
+
+static
+big*
+big_of(void* ptr)
+{
+	return (big*)(ptr - sizeof(big));
+}
 
+static
+size_t
+big_len(big* bPtr)
+{
+	return div_up(bPtr->size, PAGE_SIZE) * PAGE_SIZE;
 }
 
+// Map a large block whose payload is aligned to align, a power of two of
+// at least 16. Alignment up to a page costs at most one extra page; past
+// that the block is over-mapped and the ends are given back.
+static
 void*
-xrealloc(void* prev, size_t bytes)
+big_alloc(size_t bytes, size_t align)
 {
-	bytes += sizeof(chunk);
+	size_t offset = align < sizeof(big) ? sizeof(big) : align;
+	size_t extra = 0;
 
-	chunk* cPtr = (chunk*)((uintptr_t)prev - sizeof(chunk));
-	void* ptr = NULL;
-	long b_idx_old = bucket(cPtr->size);
-	long b_idx_new = bucket(bytes);
+	if (align > PAGE_SIZE) {
+		offset = PAGE_SIZE;
+		extra = align;
+	}
+
+	if (bytes > SIZE_MAX / 2 - offset - extra)
+		return NULL;
+
+	size_t len = div_up(offset + bytes, PAGE_SIZE) * PAGE_SIZE;
+	void* base = reclaim_map(len + extra);
+	if (!base)
+		return NULL;
+
+	if (extra) {
+		void* ptr = (void*)(((uintptr_t)base + offset + align - 1) & ~(uintptr_t)(align - 1));
+		void* start = ptr - offset;
+
+		if (start > base)
+			pages_unmap(base, start - base);
+		if (base + extra > start)
+			pages_unmap(start + len, base + extra - start);
+		base = start;
+	}
+
+	big* bPtr = big_of(base + offset);
+	bPtr->size = offset + bytes;
+	bPtr->offset = offset;
+	xstats_alloc(NUM_BUCKETS, len - offset);
+
+	return base + offset;
+}
+
+void*
+xmalloc(size_t bytes)
+{
+	if (bytes <= PAGE_SIZE)
+		return small_alloc(bucket(bytes), NULL);
+	else
+		return big_alloc(bytes, sizeof(big));
+}
+
+// Power-of-two buckets are aligned to their size, so a small aligned
+// block is just the first bucket that fits and is aligned enough.
+void*
+xmalloc_aligned(size_t align, size_t bytes)
+{
+	if (align & (align - 1))
+		return NULL;
+
+	if (align <= 8)
+		return xmalloc(bytes);
+
+	if (bytes <= PAGE_SIZE && align <= PAGE_SIZE) {
+		long b_idx = bucket(bytes < align ? align : bytes);
+
+		while ((bucket_sizes[b_idx] & -bucket_sizes[b_idx]) < align)
+			b_idx += 1;
+
+		return small_alloc(b_idx, NULL);
+	}
+
+	return big_alloc(bytes, align);
+}
+
+static
+void
+small_free(slab* sb, chunk* cPtr)
+{
+	long b_idx = sb->b_idx;
+
+	xstats_free(b_idx, bucket_sizes[b_idx]);
+
+	if (pcs) {
+		percpu_free(b_idx, cPtr);
+		return;
+	}
+
+	if (!tc_registered && !cache_register()) {
+		xstats_lock(&mutex);
+		slab_give(cPtr);
+		pthread_mutex_unlock(&mutex);
+		return;
+	}
+
+	tc.heap->frees += 1;
+
+	// Chunks from a slab another live thread is carving go back to
+	// that thread, keeping its cache warm and its slabs compact.
+	theap* owner = __atomic_load_n(&sb->owner, __ATOMIC_RELAXED);
+	if (owner && owner != tc.heap && __atomic_load_n(&owner->alive, __ATOMIC_ACQUIRE)) {
+		remote_push(owner, cPtr);
+		tc.heap->remote_frees += 1;
+		return;
+	}
+
+	cPtr->next = tc.head[b_idx];
+	tc.head[b_idx] = cPtr;
+	tc.count[b_idx] += 1;
+
+	if (tc.count[b_idx] > 2 * cache_batch(b_idx))
+		cache_release(b_idx);
+}
+
+static
+void
+big_free(void* ptr)
+{
+	big* bPtr = big_of(ptr);
+	size_t len = big_len(bPtr);
+
+	xstats_free(NUM_BUCKETS, len - bPtr->offset);
+	pages_unmap(ptr - bPtr->offset, len);
+}
+
+void
+xfree(void* ptr)
+{
+	slab* sb = span_lookup(ptr);
 
-	if (bytes <= PAGE_SIZE) {
+	if (reclaim_on && reclaim_push(ptr, sb ? bucket_sizes[sb->b_idx] : big_len(big_of(ptr))))
+		return;
+
+	if (sb)
+		small_free(sb, (chunk*)ptr);
+	else
+		big_free(ptr);
+}
+
+// Every unaligned block of at most a page lives in a slab, so the size
+// alone tells slabs from large blocks and the span map is never read.
+void
+xfree_sized(void* ptr, size_t size)
+{
+#ifdef XMALLOC_DEBUG
+	if ((span_lookup(ptr) != NULL) != (size <= PAGE_SIZE) || size > xmalloc_usable_size(ptr)) {
+		fprintf(stderr, "xfree_sized: %p is not a block of %zu bytes\n", ptr, size);
+		abort();
+	}
+#endif
+
+	if (reclaim_on && reclaim_push(ptr, size <= PAGE_SIZE ? bucket_sizes[slab_of((chunk*)ptr)->b_idx] : big_len(big_of(ptr))))
+		return;
 
-		if (b_idx_new == b_idx_old)
-			ptr = prev;
-		else {
-			ptr = xmalloc(bytes);
-			memcpy(ptr, prev, bucket_sizes[b_idx_old] - sizeof(chunk));
-			xfree(prev);
+	if (size <= PAGE_SIZE)
+		small_free(slab_of((chunk*)ptr), (chunk*)ptr);
+	else
+		big_free(ptr);
+}
+
+// Empty this thread's cache first, then whole depot batches, and carve
+// what is still missing out of the slabs in one pass under the lock.
+size_t
+xmalloc_batch(size_t bytes, size_t nn, void** out)
+{
+	size_t ii = 0;
+
+	if (bytes > PAGE_SIZE) {
+		for (; ii < nn; ii++) {
+			if (!(out[ii] = big_alloc(bytes, sizeof(big))))
+				break;
 		}
+		return ii;
+	}
+
+	long b_idx = bucket(bytes);
 
+	if (pcs) {
+		for (; ii < nn; ii++) {
+			if (!(out[ii] = percpu_pop(b_idx)))
+				break;
+		}
 	}
 	else {
-		long pages = div_up(bytes, PAGE_SIZE);
+		if (!tc_registered && !cache_register())
+			return 0;
 
-		ptr = mmap(NULL, pages * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-		if (ptr == (void*)(-1))
-			perror("xrealloc: mmap() failed");
+		if (__atomic_load_n(&tc.heap->remote, __ATOMIC_RELAXED))
+			remote_take();
 
-		memcpy(ptr, (void*)cPtr, pages * PAGE_SIZE);
-		xfree(prev);
+		for (; ii < nn && tc.head[b_idx]; ii++) {
+			out[ii] = tc.head[b_idx];
+			tc.head[b_idx] = tc.head[b_idx]->next;
+			tc.count[b_idx] -= 1;
+		}
+	}
 
-		cPtr = (chunk*)ptr;
-		cPtr->size = bucket_sizes[b_idx_new];
-		cPtr->next = NULL;
+	while (nn - ii >= cache_batch(b_idx)) {
+		batch* bt = depot_pop(b_idx);
+		if (!bt)
+			break;
 
-		ptr += sizeof(chunk);
+		for (chunk* tmp = &bt->head; tmp; tmp = tmp->next)
+			out[ii++] = tmp;
 	}
 
-	return ptr;
+	if (ii < nn) {
+		xstats_lock(&mutex);
+		for (; ii < nn; ii++) {
+			if (!buckets[b_idx] && !slab_create(b_idx))
+				break;
+			out[ii] = slab_take(buckets[b_idx], NULL);
+		}
+		pthread_mutex_unlock(&mutex);
+	}
+
+	for (size_t jj = 0; jj < ii; jj++)
+		xstats_alloc(b_idx, bucket_sizes[b_idx]);
+
+	return ii;
 }
 
+// Chunks go to this thread's cache as in xfree(). Whatever overflows it
+// goes to the depot while there is room, and the rest back to the slabs
+// in one pass under the lock.
 void
-dump_buckets()
+xfree_batch(void** ptrs, size_t nn)
 {
-	chunk* tmp = NULL;
+	int cached = !pcs && (tc_registered || cache_register());
+	chunk* spill = NULL;
+
+	for (size_t ii = 0; ii < nn; ii++) {
+		slab* sb = ptrs[ii] ? span_lookup(ptrs[ii]) : NULL;
+
+		// Large blocks are unmapped one by one anyway, and per-CPU
+		// frees do not lock.
+		if (!sb || pcs) {
+			if (ptrs[ii])
+				xfree(ptrs[ii]);
+			continue;
+		}
 
-	for (int i = 0; i < NUM_BUCKETS; i++) {
-		tmp = buckets[i];
+		chunk* cPtr = (chunk*)ptrs[ii];
+		long b_idx = sb->b_idx;
 
-		printf("%ld Bytes:\n", bucket_sizes[i]);
+		xstats_free(b_idx, bucket_sizes[b_idx]);
 
-		while (tmp) {
-			printf("addr: %p ; size: %lu\n", tmp, tmp->size);
-			tmp = tmp->next;
+		if (!cached) {
+			cPtr->next = spill;
+			spill = cPtr;
+			continue;
 		}
 
-		printf("\n");
+		tc.heap->frees += 1;
+
+		theap* owner = __atomic_load_n(&sb->owner, __ATOMIC_RELAXED);
+		if (owner && owner != tc.heap && __atomic_load_n(&owner->alive, __ATOMIC_ACQUIRE)) {
+			remote_push(owner, cPtr);
+			tc.heap->remote_frees += 1;
+			continue;
+		}
+
+		cPtr->next = tc.head[b_idx];
+		tc.head[b_idx] = cPtr;
+		tc.count[b_idx] += 1;
+	}
+
+	for (long i = 0; cached && i < NUM_BUCKETS; i++) {
+		long max = 2 * cache_batch(i);
+
+		while (tc.count[i] > max && __atomic_load_n(&depot_count[i], __ATOMIC_RELAXED) < DEPOT_MAX)
+			cache_release(i);
+
+		while (tc.count[i] > max) {
+			chunk* tmp = tc.head[i];
+			tc.head[i] = tmp->next;
+			tc.count[i] -= 1;
+			tmp->next = spill;
+			spill = tmp;
+		}
 	}
 
+	if (spill) {
+		xstats_lock(&mutex);
+		while (spill) {
+			chunk* next = spill->next;
+			slab_give(spill);
+			spill = next;
+		}
+		pthread_mutex_unlock(&mutex);
+	}
 }
 
+// Return what this thread caches and everything in the depot to the
+// slabs, release every empty slab and purge all idle pages. Chunks held
+// by other threads' caches, or per-CPU caches, stay where they are.
+int
+xmalloc_trim()
+{
+	reclaim_drain();
+
+	for (long i = 0; tc_registered && i < NUM_BUCKETS; i++) {
+		cache_flush(i, tc.count[i]);
+		fresh_flush(i);
+	}
+
+	xstats_lock(&mutex);
+	for (long i = 0; i < NUM_BUCKETS; i++) {
+		batch* bt;
+		while ((bt = depot_pop(i))) {
+			chunk* tmp = &bt->head;
+			while (tmp) {
+				chunk* next = tmp->next;
+				slab_give(tmp);
+				tmp = next;
+			}
+		}
+
+		slab* sb = buckets[i];
+		while (sb) {
+			slab* next = sb->next;
+			if (sb->nfree == sb->nslots)
+				slab_release(sb);
+			sb = next;
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+
+	return pages_purge(1) > 0;
+}
+
+// Large blocks are fresh mappings and already zero. A small slot never
+// handed out before only has its cache link to clear; recycled ones are
+// cleared in full.
+void*
+xcalloc(size_t nn, size_t size)
+{
+	int clean;
+
+	if (size && nn > SIZE_MAX / size)
+		return NULL;
+
+	size_t bytes = nn * size;
+	if (bytes > PAGE_SIZE)
+		return big_alloc(bytes, sizeof(big));
+
+	void* ptr = small_alloc(bucket(bytes), &clean);
+	if (ptr)
+		memset(ptr, 0, clean ? sizeof(chunk) : bytes);
+	return ptr;
+}
+
+size_t
+xmalloc_usable_size(void* ptr)
+{
+	slab* sb = span_lookup(ptr);
+
+	if (sb)
+		return bucket_sizes[sb->b_idx];
+
+	big* bPtr = big_of(ptr);
+	return big_len(bPtr) - bPtr->offset;
+}
+
+void*
+xrealloc(void* prev, size_t bytes)
+{
+	slab* sb = span_lookup(prev);
+	size_t have = xmalloc_usable_size(prev);
+	void* ptr = NULL;
+
+	// Slots in a slab are all one size, so there is no free neighbour to
+	// grow into. Stay put while the new size still fits the slot and would
+	// not be better served by a class at most half as big.
+	if (sb && bytes <= have && (2 * bytes > have || bucket(bytes) == sb->b_idx))
+		return prev;
+
+	// Large to large: resize the mapping itself rather than copying it
+	if (!sb && bytes > PAGE_SIZE) {
+		big* bPtr = big_of(prev);
+		size_t offset = bPtr->offset;
+		size_t oldLen = big_len(bPtr);
+
+		if (bytes > SIZE_MAX / 2 - offset)
+			return NULL;
+
+		size_t newLen = div_up(offset + bytes, PAGE_SIZE) * PAGE_SIZE;
+
+		void* base = pages_remap(prev - offset, oldLen, newLen);
+		if (!base)
+			return NULL;
+
+		big_of(base + offset)->size = offset + bytes;
+		xstats_resize(oldLen, newLen);
+		return base + offset;
+	}
+
+	ptr = xmalloc(bytes);
+	if (!ptr)
+		return NULL;
+
+	if (have < bytes)
+		memcpy(ptr, prev, have);
+	else
+		memcpy(ptr, prev, bytes);
+
+	xfree(prev);
+
+	return ptr;
+}
+
+void
+xmalloc_stats(xmalloc_stats_t* st)
+{
+	pages_stats ps;
+	size_t slots = 0;
+	size_t small = 0;
+
+	xstats_sum(st);
+
+	st->nclasses = NUM_BUCKETS + 1;
+	for (long i = 0; i < NUM_BUCKETS; i++)
+		st->classes[i].size = bucket_sizes[i];
+	st->classes[NUM_BUCKETS].size = 0;
+
+	xstats_lock(&mutex);
+	for (long i = 0; i < NUM_BUCKETS; i++) {
+		slots += slab_bytes[i];
+		small += (st->classes[i].allocs - st->classes[i].frees) * bucket_sizes[i];
+	}
+	pthread_mutex_unlock(&mutex);
+
+	st->cached = slots > small ? slots - small : 0;
+
+	pages_get_stats(&ps);
+	st->mmaps = ps.mmaps;
+	st->munmaps = ps.munmaps;
+}
@@ -0,0 +1,787 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+#include "pages.h"
+#include "stats.h"
+
+#define MiB ((size_t)1024 * 1024)
+#define HUGE_PAGE (2 * MiB)
+
+static const size_t PAGE = 4096;
+
+// A run of arena pages handed back by pages_free(), threaded through its
+// first page. Runs that were never handed out, or whose pages have been
+// purged since, are clean; the rest remember when they were freed. A run
+// never handed out is zero but for this header, which a purged one cannot
+// promise: its first page is kept, and MADV_FREE pages may come back.
+//
+// Runs sit in a list per size bucket, bucket k holding those of 2^k to
+// 2^(k+1) - 1 pages, and a run is merged with any free run either side of
+// it when it is pushed, so freed pages do not stay split up.
+typedef struct run {
+	size_t size;
+	struct run* next;     // in its bucket
+	struct run* prev;
+	long freed;           // ms on the monotonic clock, or one of these
+} run;
+
+#define RUN_FRESH  -1
+#define RUN_PURGED -2
+#define RUN_BUCKETS 32
+
+// Where every run starts and ends, so a run being pushed finds its free
+// neighbours without a walk: an open-addressing table keyed by the start
+// address, or by the end address with the low bit set. A run left out
+// because the table could not grow is simply never merged.
+typedef struct edge {
+	uintptr_t key;
+	run* rr;
+} edge;
+
+static pthread_mutex_t pages_lock = PTHREAD_MUTEX_INITIALIZER;
+static void* arena_next = NULL;   // bump pointer into the current arena
+static void* arena_end = NULL;
+static size_t arena_size = 0;     // 0 until configured on first use
+static run* runs[RUN_BUCKETS];
+static edge* edges = NULL;
+static size_t edges_cap = 0;      // a power of two
+static size_t edges_used = 0;
+static pages_stats stats;
+static int use_thp = -1;          // -1 until configured on first use
+static long decay_ms = 10000;     // -1 to purge only when asked
+static int purge_advice = MADV_DONTNEED;
+static long purge_at = -1;        // when the oldest dirty run expires
+static int purge_thread = 0;      // XMALLOC_PURGE_THREAD
+
+static
+void
+count(long* counter)
+{
+	__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+static
+void
+arena_config()
+{
+	long mb = 4;
+	char* env = getenv("XMALLOC_ARENA_MB");
+
+	if (env)
+		mb = atol(env);
+	if (mb < 1)
+		mb = 1;
+	if (mb > 64)
+		mb = 64;
+
+	arena_size = mb * MiB;
+
+	env = getenv("XMALLOC_THP");
+	use_thp = env && atol(env) > 0;
+	if (use_thp)
+		arena_size = (arena_size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+
+	env = getenv("XMALLOC_DECAY_MS");
+	if (env)
+		decay_ms = atol(env) < 0 ? -1 : atol(env);
+
+	env = getenv("XMALLOC_PURGE");
+	if (env && strcmp(env, "free") == 0)
+		purge_advice = MADV_FREE;
+
+	env = getenv("XMALLOC_PURGE_THREAD");
+	if (env && atol(env) > 0 && decay_ms >= 0)
+		purge_thread = 1;
+
+	if (getenv("XMALLOC_STATS"))
+		atexit(pages_report);
+}
+
+static
+long
+now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Make sure a purge is due by at. Read without the lock by purge_poll().
+// Must hold pages_lock.
+static
+void
+purge_schedule(long at)
+{
+	if (purge_at < 0 || at < purge_at)
+		__atomic_store_n(&purge_at, at, __ATOMIC_RELAXED);
+}
+
+static
+size_t
+edge_hash(uintptr_t key)
+{
+	return ((key >> 12) * 0x9E3779B97F4A7C15ull >> 32) & (edges_cap - 1);
+}
+
+static
+size_t
+edge_step(size_t ii)
+{
+	return (ii + 1) & (edges_cap - 1);
+}
+
+// Must hold pages_lock.
+static
+run*
+edge_find(uintptr_t key)
+{
+	if (!edges)
+		return NULL;
+
+	for (size_t ii = edge_hash(key); edges[ii].key; ii = edge_step(ii)) {
+		if (edges[ii].key == key)
+			return edges[ii].rr;
+	}
+
+	return NULL;
+}
+
+// The table must have room. Must hold pages_lock.
+static
+void
+edge_put(uintptr_t key, run* rr)
+{
+	size_t ii = edge_hash(key);
+
+	while (edges[ii].key)
+		ii = edge_step(ii);
+
+	edges[ii].key = key;
+	edges[ii].rr = rr;
+	edges_used += 1;
+}
+
+// Delete by shifting later entries of the probe sequence back into the
+// hole, so no lookup ever stops short. Must hold pages_lock.
+static
+void
+edge_del(uintptr_t key)
+{
+	size_t ii;
+
+	if (!edges)
+		return;
+
+	for (ii = edge_hash(key); edges[ii].key != key; ii = edge_step(ii)) {
+		if (!edges[ii].key)
+			return;
+	}
+
+	for (size_t jj = edge_step(ii); edges[jj].key; jj = edge_step(jj)) {
+		size_t home = edge_hash(edges[jj].key);
+
+		// Move the entry at jj unless its home lies in (ii, jj].
+		if (jj > ii ? home <= ii || home > jj : home <= ii && home > jj) {
+			edges[ii] = edges[jj];
+			ii = jj;
+		}
+	}
+
+	edges[ii].key = 0;
+	edges_used -= 1;
+}
+
+// Make room for two more edges, at most half full. Must hold pages_lock.
+static
+int
+edges_reserve()
+{
+	if (2 * (edges_used + 2) <= edges_cap)
+		return 1;
+
+	edge* old = edges;
+	size_t old_cap = edges_cap;
+	size_t cap = old ? 2 * old_cap : 256;
+
+	count(&stats.mmaps);
+	edge* tab = mmap(NULL, cap * sizeof(edge), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (tab == MAP_FAILED)
+		return 0;
+
+	edges = tab;
+	edges_cap = cap;
+	edges_used = 0;
+
+	for (size_t ii = 0; ii < old_cap; ii++) {
+		if (old[ii].key)
+			edge_put(old[ii].key, old[ii].rr);
+	}
+
+	if (old) {
+		count(&stats.munmaps);
+		munmap(old, old_cap * sizeof(edge));
+	}
+
+	return 1;
+}
+
+static
+long
+run_bucket(size_t bytes)
+{
+	long kk = 63 - __builtin_clzl(bytes / PAGE);
+	return kk < RUN_BUCKETS ? kk : RUN_BUCKETS - 1;
+}
+
+// Must hold pages_lock.
+static
+void
+run_link(run* rr)
+{
+	long kk = run_bucket(rr->size);
+
+	rr->prev = NULL;
+	rr->next = runs[kk];
+	if (rr->next)
+		rr->next->prev = rr;
+	runs[kk] = rr;
+
+	if (edges_reserve()) {
+		edge_put((uintptr_t)rr, rr);
+		edge_put(((uintptr_t)rr + rr->size) | 1, rr);
+	}
+}
+
+// Must hold pages_lock.
+static
+void
+run_unlink(run* rr)
+{
+	if (rr->prev)
+		rr->prev->next = rr->next;
+	else
+		runs[run_bucket(rr->size)] = rr->next;
+
+	if (rr->next)
+		rr->next->prev = rr->prev;
+
+	edge_del((uintptr_t)rr);
+	edge_del(((uintptr_t)rr + rr->size) | 1);
+}
+
+// The state of two runs merged: dirty if either is, since the older time
+// so no page is kept past its decay, and fresh only if both are.
+static
+long
+run_merge(long aa, long bb)
+{
+	if (aa >= 0 && bb >= 0)
+		return aa < bb ? aa : bb;
+	if (aa >= 0 || bb >= 0)
+		return aa >= 0 ? aa : bb;
+	return aa == RUN_FRESH && bb == RUN_FRESH ? RUN_FRESH : RUN_PURGED;
+}
+
+// Put [ptr, ptr + bytes) on the run lists, merged with the free runs on
+// either side, dirty since freed unless that is RUN_FRESH or RUN_PURGED.
+// Must hold pages_lock.
+static
+void
+run_push(void* ptr, size_t bytes, long freed)
+{
+	run* left = edge_find((uintptr_t)ptr | 1);
+	run* right = edge_find((uintptr_t)ptr + bytes);
+
+	if (right) {
+		run_unlink(right);
+		freed = run_merge(freed, right->freed);
+		bytes += right->size;
+	}
+
+	if (left) {
+		run_unlink(left);
+		freed = run_merge(left->freed, freed);
+		bytes += left->size;
+		ptr = left;
+	}
+
+	// A fresh run is zero but for its own header.
+	if (right && freed == RUN_FRESH)
+		memset(right, 0, sizeof(run));
+
+	run* rr = (run*)ptr;
+	rr->size = bytes;
+	rr->freed = freed;
+	run_link(rr);
+
+	if (freed >= 0 && decay_ms >= 0)
+		purge_schedule(freed + decay_ms);
+}
+
+// Purge every dirty run freed at least decay_ms before now, or all of
+// them if force. Returns the bytes purged. Must hold pages_lock.
+static
+size_t
+purge_runs(int force, long now)
+{
+	size_t bytes = 0;
+
+	__atomic_store_n(&purge_at, -1, __ATOMIC_RELAXED);
+
+	for (long kk = 0; kk < RUN_BUCKETS; kk++) {
+		for (run* rr = runs[kk]; rr; rr = rr->next) {
+			if (rr->freed < 0)
+				continue;
+
+			if (!force && (decay_ms < 0 || now - rr->freed < decay_ms)) {
+				if (decay_ms >= 0)
+					purge_schedule(rr->freed + decay_ms);
+				continue;
+			}
+
+			if (rr->size > PAGE) {
+				stats.purges += 1;
+				// Kernels before 4.5 do not know MADV_FREE.
+				if (madvise((void*)rr + PAGE, rr->size - PAGE, purge_advice) == -1 && purge_advice != MADV_DONTNEED) {
+					purge_advice = MADV_DONTNEED;
+					madvise((void*)rr + PAGE, rr->size - PAGE, purge_advice);
+				}
+				bytes += rr->size - PAGE;
+			}
+
+			rr->freed = RUN_PURGED;
+		}
+	}
+
+	stats.purged += bytes;
+	return bytes;
+}
+
+// Purge whatever has decayed. Cheap when nothing has. Must hold
+// pages_lock.
+static
+void
+purge_tick()
+{
+	if (purge_at < 0)
+		return;
+
+	long now = now_ms();
+	if (now >= purge_at)
+		purge_runs(0, now);
+}
+
+// purge_tick() for callers that do not hold pages_lock, which is only
+// taken once something is due.
+static
+void
+purge_poll()
+{
+	long at = __atomic_load_n(&purge_at, __ATOMIC_RELAXED);
+
+	if (at < 0 || now_ms() < at)
+		return;
+
+	xstats_lock(&pages_lock);
+	purge_tick();
+	pthread_mutex_unlock(&pages_lock);
+}
+
+static
+void*
+purge_main(void* _arg)
+{
+	long ms = decay_ms / 2 < 10 ? 10 : decay_ms / 2;
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+
+	for (;;) {
+		nanosleep(&ts, NULL);
+		purge_poll();
+	}
+
+	return NULL;
+}
+
+// Start the purge thread if it is wanted. Allocation paths can run
+// inside the dynamic loader, where creating a thread deadlocks, so this
+// waits for constructors.
+__attribute__((constructor))
+static
+void
+purge_thread_start()
+{
+	pthread_t tid;
+	pthread_attr_t attr;
+
+	xstats_lock(&pages_lock);
+	if (!arena_size)
+		arena_config();
+	pthread_mutex_unlock(&pages_lock);
+
+	if (!purge_thread)
+		return;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attr, 32 * 1024);
+	if (pthread_create(&tid, &attr, purge_main, NULL) != 0)
+		perror("xmalloc: purge thread");
+	pthread_attr_destroy(&attr);
+}
+
+static
+int
+thp_enabled()
+{
+	if (use_thp < 0) {
+		xstats_lock(&pages_lock);
+		if (!arena_size)
+			arena_config();
+		pthread_mutex_unlock(&pages_lock);
+	}
+
+	return __atomic_load_n(&use_thp, __ATOMIC_RELAXED);
+}
+
+// Map bytes at a 2 MiB boundary by over-mapping and trimming the ends.
+// Returns MAP_FAILED like mmap.
+static
+void*
+map_huge_aligned(size_t bytes, int flags)
+{
+	count(&stats.mmaps);
+	void* ptr = mmap(NULL, bytes + HUGE_PAGE, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (ptr == MAP_FAILED)
+		return MAP_FAILED;
+
+	void* base = (void*)(((uintptr_t)ptr + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+
+	if (base > ptr) {
+		count(&stats.munmaps);
+		munmap(ptr, base - ptr);
+	}
+
+	if (ptr + HUGE_PAGE > base) {
+		count(&stats.munmaps);
+		munmap(base + bytes, ptr + HUGE_PAGE - base);
+	}
+
+	return base;
+}
+
+// Ask for huge pages on [ptr, ptr + bytes). A kernel without THP says
+// EINVAL, after which we stop asking.
+static
+void
+advise_huge(void* ptr, size_t bytes)
+{
+	count(&stats.madvises);
+	if (madvise(ptr, bytes, MADV_HUGEPAGE) == -1) {
+		__atomic_store_n(&use_thp, 0, __ATOMIC_RELAXED);
+		return;
+	}
+
+	__atomic_add_fetch(&stats.huge_advised, bytes, __ATOMIC_RELAXED);
+}
+
+// Reserve a new arena of at least min bytes. The mapping is
+// MAP_NORESERVE and never touched here, so the kernel only commits the
+// pages that are actually used. Under a tight RLIMIT_AS the reservation
+// is halved until it fits. Must hold pages_lock.
+static
+int
+arena_reserve(size_t min)
+{
+	size_t size = arena_size;
+
+	while (size < min)
+		size *= 2;
+
+	if (arena_end - arena_next >= PAGE)
+		run_push(arena_next, (arena_end - arena_next) & ~(PAGE - 1), RUN_FRESH);
+
+	for (;;) {
+		int flags = MAP_PRIVATE | MAP_ANON | MAP_NORESERVE;
+		void* ptr = MAP_FAILED;
+
+		if (use_thp && size % HUGE_PAGE == 0) {
+			ptr = map_huge_aligned(size, flags);
+			if (ptr != MAP_FAILED)
+				advise_huge(ptr, size);
+		}
+
+		if (ptr == MAP_FAILED) {
+			count(&stats.mmaps);
+			ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+		}
+
+		if (ptr != MAP_FAILED) {
+			arena_next = ptr;
+			arena_end = ptr + size;
+			stats.arenas += 1;
+			stats.reserved += size;
+			return 1;
+		}
+
+		if (size / 2 < min) {
+			perror("pages_alloc: mmap() failed");
+			return 0;
+		}
+
+		size /= 2;
+	}
+}
+
+// Hand out bytes (a multiple of the page size) aligned to align (a power
+// of two, at least the page size), preferring previously freed runs. The
+// search starts at the bucket bytes falls in, and an aligned range may be
+// cut from anywhere in a run, the pages either side going back as runs.
+// If clean is not NULL it is set when the pages are known to be zero.
+void*
+pages_alloc_clean(size_t bytes, size_t align, int* clean)
+{
+	void* ptr = NULL;
+
+	xstats_lock(&pages_lock);
+
+	if (!arena_size)
+		arena_config();
+
+	purge_tick();
+
+	for (long kk = run_bucket(bytes); kk < RUN_BUCKETS; kk++) {
+		for (run* rr = runs[kk]; rr; rr = rr->next) {
+			void* end = (void*)rr + rr->size;
+			ptr = (void*)(((uintptr_t)rr + align - 1) & ~(align - 1));
+
+			if (ptr + bytes > end)
+				continue;
+
+			long freed = rr->freed;
+			run_unlink(rr);
+			if (ptr > (void*)rr)
+				run_push(rr, ptr - (void*)rr, freed);
+			if (ptr + bytes < end)
+				run_push(ptr + bytes, end - ptr - bytes, freed);
+
+			if (clean) {
+				*clean = freed == RUN_FRESH;
+				if (*clean && ptr == (void*)rr)
+					memset(rr, 0, sizeof(run));
+			}
+
+			pthread_mutex_unlock(&pages_lock);
+			return ptr;
+		}
+	}
+
+	ptr = (void*)(((uintptr_t)arena_next + align - 1) & ~(align - 1));
+
+	if (!arena_next || ptr + bytes > arena_end) {
+		if (!arena_reserve(bytes + align)) {
+			pthread_mutex_unlock(&pages_lock);
+			return NULL;
+		}
+
+		ptr = (void*)(((uintptr_t)arena_next + align - 1) & ~(align - 1));
+	}
+
+	if (ptr > arena_next)
+		run_push(arena_next, ptr - arena_next, RUN_FRESH);
+
+	arena_next = ptr + bytes;
+	stats.handed_out += bytes;
+	if (clean)
+		*clean = 1;
+
+	pthread_mutex_unlock(&pages_lock);
+	return ptr;
+}
+
+void*
+pages_alloc(size_t bytes, size_t align)
+{
+	return pages_alloc_clean(bytes, align, NULL);
+}
+
+void
+pages_free(void* ptr, size_t bytes)
+{
+	xstats_lock(&pages_lock);
+	run_push(ptr, bytes, now_ms());
+	purge_tick();
+	pthread_mutex_unlock(&pages_lock);
+}
+
+// Purge idle runs now, every dirty one if force, whatever the decay
+// time. Returns the bytes purged.
+size_t
+pages_purge(int force)
+{
+	xstats_lock(&pages_lock);
+	size_t bytes = purge_runs(force, now_ms());
+	pthread_mutex_unlock(&pages_lock);
+	return bytes;
+}
+
+// Large blocks get a mapping of their own. Returns NULL without a word
+// if mmap fails, for callers with something to try before giving up.
+void*
+pages_try_map(size_t bytes)
+{
+	void* ptr = MAP_FAILED;
+
+	if (bytes >= HUGE_PAGE && thp_enabled()) {
+		ptr = map_huge_aligned(bytes, MAP_PRIVATE | MAP_ANON);
+		if (ptr != MAP_FAILED)
+			advise_huge(ptr, bytes);
+	}
+
+	if (ptr == MAP_FAILED) {
+		count(&stats.mmaps);
+		ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	}
+
+	if (ptr == MAP_FAILED)
+		return NULL;
+
+	purge_poll();
+	return ptr;
+}
+
+void*
+pages_map(size_t bytes)
+{
+	void* ptr = pages_try_map(bytes);
+	if (!ptr)
+		perror("xmalloc: mmap() failed");
+	return ptr;
+}
+
+void
+pages_unmap(void* ptr, size_t bytes)
+{
+	count(&stats.munmaps);
+	int err = munmap(ptr, bytes);
+	if (err == -1)
+		perror("xfree: munmap() failed");
+
+	purge_poll();
+}
+
+// Resize a pages_map() mapping. Shrinking gives the tail pages back where
+// they are; growing lets the kernel move the page tables instead of
+// copying the contents. Returns NULL (leaving the old mapping alone) on
+// failure.
+void*
+pages_remap(void* ptr, size_t old_bytes, size_t new_bytes)
+{
+	if (new_bytes == old_bytes)
+		return ptr;
+
+	if (new_bytes < old_bytes) {
+		pages_unmap(ptr + new_bytes, old_bytes - new_bytes);
+		return ptr;
+	}
+
+	count(&stats.mremaps);
+	void* new = mremap(ptr, old_bytes, new_bytes, MREMAP_MAYMOVE);
+	if (new == MAP_FAILED) {
+		perror("xrealloc: mremap() failed");
+		return NULL;
+	}
+
+	return new;
+}
+
+// Drop the contents of every whole page inside [ptr, ptr + bytes), for
+// free memory an allocator keeps mapped. Returns the bytes dropped.
+size_t
+pages_discard(void* ptr, size_t bytes)
+{
+	uintptr_t start = ((uintptr_t)ptr + PAGE - 1) & ~(PAGE - 1);
+	uintptr_t end = ((uintptr_t)ptr + bytes) & ~(PAGE - 1);
+
+	if (end <= start)
+		return 0;
+
+	xstats_lock(&pages_lock);
+	stats.purges += 1;
+	stats.purged += end - start;
+	pthread_mutex_unlock(&pages_lock);
+
+	madvise((void*)start, end - start, MADV_DONTNEED);
+	return end - start;
+}
+
+void
+pages_get_stats(pages_stats* st)
+{
+	xstats_lock(&pages_lock);
+	*st = stats;
+	pthread_mutex_unlock(&pages_lock);
+}
+
+// Number of mappings in the whole process, from /proc/self/maps.
+long
+pages_vmas()
+{
+	FILE* fh = fopen("/proc/self/maps", "r");
+	long nn = 0;
+	int cc;
+
+	if (!fh)
+		return -1;
+
+	while ((cc = fgetc(fh)) != EOF) {
+		if (cc == '\n')
+			nn += 1;
+	}
+
+	fclose(fh);
+	return nn;
+}
+
+// Huge pages the kernel actually gave the process, from AnonHugePages in
+// /proc/self/smaps_rollup.
+long
+pages_huge()
+{
+	FILE* fh = fopen("/proc/self/smaps_rollup", "r");
+	char line[128];
+	long kb = 0;
+
+	if (!fh)
+		return -1;
+
+	while (fgets(line, sizeof(line), fh)) {
+		if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1)
+			break;
+	}
+
+	fclose(fh);
+	return kb * 1024 / HUGE_PAGE;
+}
+
+void
+pages_report()
+{
+	pages_stats st;
+	pages_get_stats(&st);
+
+	fprintf(stderr, "xmalloc: %ld mmap, %ld munmap, %ld mremap, %ld arenas (%zu KiB reserved, %zu KiB used), %ld VMAs\n",
+			st.mmaps, st.munmaps, st.mremaps, st.arenas, st.reserved / 1024, st.handed_out / 1024, pages_vmas());
+
+	if (st.purges)
+		fprintf(stderr, "xmalloc: %ld purges, %zu KiB purged\n", st.purges, st.purged / 1024);
+
+	if (st.madvises)
+		fprintf(stderr, "xmalloc: THP %s, %zu KiB advised, %ld huge pages in use\n",
+				use_thp ? "on" : "refused", st.huge_advised / 1024, pages_huge());
+}
@@ -0,0 +1,59 @@
+#ifndef PAGES_H
+#define PAGES_H
+
+#include <stddef.h>
+
+// Page source shared by hwx_malloc and opt_malloc.
+//
+// Small-object pages come out of large arenas reserved up front
+// (XMALLOC_ARENA_MB, 1 to 64 MiB, default 4) instead of one mmap per page.
+// Large blocks still get their own mapping so they can be unmapped alone.
+// pages_alloc_clean() also says whether the pages are known to be zero,
+// which only arena space never handed out before is.
+//
+// With XMALLOC_THP=1 arenas and large mappings of at least 2 MiB are
+// 2 MiB aligned and advised MADV_HUGEPAGE. If the kernel refuses the
+// advice the mode switches itself off and everything keeps working on
+// normal pages.
+//
+// Runs handed back with pages_free() merge with any free run next to them,
+// so a later request can take pages freed in separate calls in one piece.
+// Runs are purged once they have been idle for XMALLOC_DECAY_MS (default
+// 10000, -1 for never): everything but their first page, which holds the
+// run header, is released with madvise(MADV_DONTNEED), or MADV_FREE with
+// XMALLOC_PURGE=free. Decay is
+// checked whenever pages are allocated or freed, and also every half
+// decay period on a background thread with XMALLOC_PURGE_THREAD=1. That
+// thread's address space, small as it is, is enough to push frag-opt past
+// frag_main's 16 MiB RLIMIT_AS.
+
+typedef struct pages_stats {
+	long mmaps;         // mmap calls, arenas and large blocks
+	long munmaps;       // munmap calls
+	long mremaps;       // mremap calls
+	long arenas;        // arenas reserved so far
+	size_t reserved;    // bytes of address space held by arenas
+	size_t handed_out;  // arena bytes given out at least once
+	long madvises;      // madvise calls
+	size_t huge_advised; // bytes advised MADV_HUGEPAGE
+	long purges;        // madvise calls purging idle runs
+	size_t purged;      // bytes purged
+} pages_stats;
+
+void* pages_alloc(size_t bytes, size_t align);
+void* pages_alloc_clean(size_t bytes, size_t align, int* clean);
+void  pages_free(void* ptr, size_t bytes);
+
+void* pages_map(size_t bytes);
+void* pages_try_map(size_t bytes);
+void  pages_unmap(void* ptr, size_t bytes);
+void* pages_remap(void* ptr, size_t old_bytes, size_t new_bytes);
+size_t pages_purge(int force);
+size_t pages_discard(void* ptr, size_t bytes);
+
+void pages_get_stats(pages_stats* st);
+long pages_vmas();
+long pages_huge();
+void pages_report();
+
+#endif
@@ -0,0 +1,155 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+
+#include "xmalloc.h"
+
+// The C allocation interface on top of opt_malloc, built as
+// libxmalloc.so so existing programs can be run with
+//
+//   LD_PRELOAD=./libxmalloc.so program
+//
+// Nothing here or in opt_malloc.c needs the allocator it replaces: pages
+// come straight from mmap, there is no dlsym(RTLD_NEXT, "malloc") to
+// bootstrap, and the bucket lookup is computed rather than built by a
+// constructor, so calls made before constructors run are fine. The
+// library is built with -ftls-model=initial-exec so its thread caches
+// never go through __tls_get_addr, which may itself allocate, and with
+// -fvisibility=hidden so only the names below are exported.
+
+#define EXPORT __attribute__((visibility("default")))
+
+static
+void*
+check(void* ptr)
+{
+	if (!ptr)
+		errno = ENOMEM;
+	return ptr;
+}
+
+EXPORT
+void*
+malloc(size_t bytes)
+{
+	return check(xmalloc(bytes));
+}
+
+EXPORT
+void
+free(void* ptr)
+{
+	if (ptr)
+		xfree(ptr);
+}
+
+EXPORT
+void*
+realloc(void* ptr, size_t bytes)
+{
+	if (!ptr)
+		return malloc(bytes);
+
+	if (!bytes) {
+		xfree(ptr);
+		return NULL;
+	}
+
+	return check(xrealloc(ptr, bytes));
+}
+
+// glibc's reallocarray calls its own realloc directly, so it has to be
+// replaced too.
+EXPORT
+void*
+reallocarray(void* ptr, size_t nn, size_t size)
+{
+	if (size && nn > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return realloc(ptr, nn * size);
+}
+
+EXPORT
+void*
+calloc(size_t nn, size_t size)
+{
+	if (size && nn > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return check(xcalloc(nn, size));
+}
+
+static
+int
+valid_align(size_t align)
+{
+	return align && !(align & (align - 1));
+}
+
+EXPORT
+int
+posix_memalign(void** out, size_t align, size_t bytes)
+{
+	if (!valid_align(align) || align % sizeof(void*))
+		return EINVAL;
+
+	void* ptr = xmalloc_aligned(align, bytes);
+	if (!ptr)
+		return ENOMEM;
+
+	*out = ptr;
+	return 0;
+}
+
+EXPORT
+void*
+aligned_alloc(size_t align, size_t bytes)
+{
+	if (!valid_align(align)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return check(xmalloc_aligned(align, bytes));
+}
+
+EXPORT
+void*
+memalign(size_t align, size_t bytes)
+{
+	return aligned_alloc(align, bytes);
+}
+
+EXPORT
+void*
+valloc(size_t bytes)
+{
+	return check(xmalloc_aligned(4096, bytes));
+}
+
+EXPORT
+void*
+pvalloc(size_t bytes)
+{
+	return check(xmalloc_aligned(4096, (bytes + 4095) & ~(size_t)4095));
+}
+
+EXPORT
+size_t
+malloc_usable_size(void* ptr)
+{
+	return ptr ? xmalloc_usable_size(ptr) : 0;
+}
+
+EXPORT
+int
+malloc_trim(size_t pad)
+{
+	return xmalloc_trim();
+}
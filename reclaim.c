@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+#include "xmalloc.h"
+#include "pages.h"
+#include "reclaim.h"
+
+int reclaim_on = 0;
+
+static pthread_mutex_t queues_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static rqueue* queues = NULL;
+static pthread_key_t reclaim_key;
+static sem_t wake;
+static __thread rqueue* mine = NULL;
+static __thread int reclaiming = 0;   // the reclaim thread never queues
+
+static
+void
+queue_retire(void* arg)
+{
+	rqueue* qq = (rqueue*)arg;
+	__atomic_store_n(&qq->alive, 0, __ATOMIC_RELEASE);
+}
+
+// Queues come straight from mmap, not from the allocator they serve. A
+// dead thread's queue goes to the next new thread, still holding whatever
+// the reclaimer has not got to; it only ever has one producer at a time.
+static
+rqueue*
+queue_register()
+{
+	rqueue* qq = NULL;
+
+	pthread_mutex_lock(&queues_lock);
+	for (rqueue* tmp = queues; tmp; tmp = tmp->next) {
+		if (!__atomic_load_n(&tmp->alive, __ATOMIC_ACQUIRE)) {
+			qq = tmp;
+			break;
+		}
+	}
+
+	if (!qq) {
+		qq = mmap(NULL, sizeof(rqueue), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+		if (qq == MAP_FAILED) {
+			pthread_mutex_unlock(&queues_lock);
+			return NULL;
+		}
+
+		qq->next = queues;
+		__atomic_store_n(&queues, qq, __ATOMIC_RELEASE);
+	}
+
+	__atomic_store_n(&qq->alive, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&queues_lock);
+
+	pthread_setspecific(reclaim_key, qq);
+	mine = qq;
+	return qq;
+}
+
+// Queue ptr, bytes long, for the reclaim thread. Returns 0 if the caller
+// has to free it now: deferring is off, or this thread's queue is full.
+int
+reclaim_push(void* ptr, size_t bytes)
+{
+	rqueue* qq = mine;
+
+	if (!reclaim_on || reclaiming)
+		return 0;
+
+	if (!qq && !(qq = queue_register()))
+		return 0;
+
+	size_t head = qq->head;
+	size_t held = head - __atomic_load_n(&qq->tail, __ATOMIC_ACQUIRE);
+
+	if (held == RECLAIM_DEPTH || __atomic_load_n(&qq->bytes, __ATOMIC_RELAXED) + bytes > RECLAIM_BYTES)
+		return 0;
+
+	qq->ptrs[head % RECLAIM_DEPTH] = ptr;
+	qq->sizes[head % RECLAIM_DEPTH] = bytes;
+	__atomic_add_fetch(&qq->bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_store_n(&qq->head, head + 1, __ATOMIC_RELEASE);
+
+	if (held + 1 == RECLAIM_DEPTH / 2)
+		sem_post(&wake);
+
+	return 1;
+}
+
+// Free everything queued so far, a queue at a time. Only one thread
+// empties queues at once, which keeps each ring single-consumer. Returns
+// how many blocks were freed.
+size_t
+reclaim_drain()
+{
+	void* ptrs[RECLAIM_DEPTH];
+	size_t total = 0;
+
+	if (!reclaim_on)
+		return 0;
+
+	pthread_mutex_lock(&drain_lock);
+	reclaiming += 1;
+
+	for (rqueue* qq = __atomic_load_n(&queues, __ATOMIC_ACQUIRE); qq; qq = qq->next) {
+		size_t tail = qq->tail;
+		size_t head = __atomic_load_n(&qq->head, __ATOMIC_ACQUIRE);
+		size_t bytes = 0;
+		size_t nn = 0;
+
+		for (; tail != head; tail++, nn++) {
+			ptrs[nn] = qq->ptrs[tail % RECLAIM_DEPTH];
+			bytes += qq->sizes[tail % RECLAIM_DEPTH];
+		}
+
+		if (nn == 0)
+			continue;
+
+		__atomic_store_n(&qq->tail, tail, __ATOMIC_RELEASE);
+		xfree_batch(ptrs, nn);
+		__atomic_sub_fetch(&qq->bytes, bytes, __ATOMIC_RELAXED);
+		total += nn;
+	}
+
+	reclaiming -= 1;
+	pthread_mutex_unlock(&drain_lock);
+	return total;
+}
+
+// pages_map() for large blocks. Only if the address space has run out
+// does the caller free what is queued, and then it maps once more; the
+// reclaim thread does the rest, so large allocations never wait on
+// drain_lock in the common case.
+void*
+reclaim_map(size_t bytes)
+{
+	void* ptr = pages_try_map(bytes);
+
+	if (!ptr && reclaim_drain())
+		ptr = pages_try_map(bytes);
+	if (!ptr)
+		perror("xmalloc: mmap() failed");
+	return ptr;
+}
+
+// Wakes when a queue is half full, and every RECLAIM_MS regardless.
+static
+void*
+reclaim_main(void* _arg)
+{
+	struct timespec ts;
+
+	for (;;) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += RECLAIM_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec += 1;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		while (sem_timedwait(&wake, &ts) == -1 && errno == EINTR)
+			;
+
+		reclaim_drain();
+	}
+
+	return NULL;
+}
+
+// Creating the thread from inside an allocation can deadlock in the
+// dynamic loader, so it starts from a constructor and xfree() frees in
+// place until it is up.
+__attribute__((constructor))
+static
+void
+reclaim_init()
+{
+	pthread_t tid;
+	pthread_attr_t attr;
+	char* env = getenv("XMALLOC_DEFER");
+
+	if (!env || atol(env) <= 0)
+		return;
+
+	if (sem_init(&wake, 0, 0) == -1 || pthread_key_create(&reclaim_key, queue_retire) != 0) {
+		perror("xmalloc: deferred free");
+		return;
+	}
+
+	// The thread needs little stack, and a default-sized one would eat
+	// into a tight RLIMIT_AS.
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attr, 32 * 1024);
+	if (pthread_create(&tid, &attr, reclaim_main, NULL) != 0)
+		perror("xmalloc: reclaim thread");
+	else
+		__atomic_store_n(&reclaim_on, 1, __ATOMIC_RELEASE);
+	pthread_attr_destroy(&attr);
+}
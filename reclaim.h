@@ -0,0 +1,36 @@
+#ifndef RECLAIM_H
+#define RECLAIM_H
+
+#include <stddef.h>
+
+// Deferred frees for hwx_malloc and opt_malloc.
+//
+// With XMALLOC_DEFER=1, xfree() hands the block to a queue of the calling
+// thread's own and returns; a reclaim thread empties every queue through
+// xfree_batch(), so the locking and coalescing happen off the caller's
+// path and in batches. Each queue is a single-producer, single-consumer
+// ring, so neither side locks. A thread holds back at most RECLAIM_DEPTH
+// blocks and RECLAIM_BYTES bytes; past that its frees are done in place,
+// which keeps both the backlog and the memory it pins bounded.
+
+#define RECLAIM_DEPTH 256
+#define RECLAIM_BYTES ((size_t)1 << 20)
+#define RECLAIM_MS 10         // longest a queued block waits for the thread
+
+typedef struct rqueue {
+	size_t head;          // next slot to fill, written by the owner
+	size_t tail;          // next slot to empty, written by the reclaimer
+	size_t bytes;         // held back right now
+	int alive;
+	struct rqueue* next;
+	void* ptrs[RECLAIM_DEPTH];
+	size_t sizes[RECLAIM_DEPTH];
+} rqueue;
+
+extern int reclaim_on;
+
+int    reclaim_push(void* ptr, size_t bytes);
+size_t reclaim_drain();
+void*  reclaim_map(size_t bytes);
+
+#endif
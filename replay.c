@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "xmalloc.h"
+#include "trace.h"
+
+// Replay a trace written by a trace build (see trace.c) against whichever
+// backend this is linked with, then report the time taken and peak RSS.
+//
+// Calls are replayed one after another on a single thread, in recorded
+// order, so every run does exactly the same work. Each page of every
+// block is written once so RSS reflects what the program would have
+// touched. The trace is streamed and the ID table is plain malloc memory
+// (not the backend's), a few MB at most, which shows up in the start RSS.
+
+#define CHUNK_RECS 4096
+
+static void** objs = NULL;    // ID to current pointer
+static size_t objs_cap = 0;
+
+static
+void
+touch(void* ptr, size_t bytes)
+{
+	for (size_t ii = 0; ii < bytes; ii += 4096)
+		((char*)ptr)[ii] = 1;
+	if (bytes)
+		((char*)ptr)[bytes - 1] = 1;
+}
+
+static
+void**
+obj_slot(uint32_t id)
+{
+	if (id >= objs_cap) {
+		size_t cap = objs_cap ? objs_cap : 1024;
+		while (cap <= id)
+			cap *= 2;
+
+		objs = realloc(objs, cap * sizeof(void*));
+		if (!objs) {
+			perror("replay: realloc() failed");
+			exit(1);
+		}
+		memset(objs + objs_cap, 0, (cap - objs_cap) * sizeof(void*));
+		objs_cap = cap;
+	}
+
+	return &objs[id];
+}
+
+static
+long
+peak_kb()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss;
+}
+
+static
+double
+seconds(struct timespec* t0, struct timespec* t1)
+{
+	return (t1->tv_sec - t0->tv_sec) + (t1->tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+int
+main(int argc, char* argv[])
+{
+	static trace_rec recs[CHUNK_RECS];
+	struct timespec t0, t1;
+	trace_head head;
+	long ops = 0;
+	long failed = 0;
+	int threads = 0;
+	uint64_t span = 0;
+
+	if (argc != 2) {
+		printf("Usage:\n\t%s trace-file\n", argv[0]);
+		return 1;
+	}
+
+	FILE* fh = fopen(argv[1], "r");
+	if (!fh) {
+		perror("replay: fopen() failed");
+		return 1;
+	}
+
+	if (fread(&head, sizeof(head), 1, fh) != 1 || memcmp(head.magic, TRACE_MAGIC, 4) ||
+			head.rec_size != sizeof(trace_rec)) {
+		fprintf(stderr, "replay: %s is not a trace\n", argv[1]);
+		return 1;
+	}
+
+	long start_kb = peak_kb();
+	double busy = 0;
+	size_t nn;
+
+	while ((nn = fread(recs, sizeof(trace_rec), CHUNK_RECS, fh)) > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+
+		for (size_t ii = 0; ii < nn; ii++) {
+			trace_rec* rec = &recs[ii];
+			void** obj = obj_slot(rec->id);
+
+			switch (rec->op) {
+			case TRACE_MALLOC:
+				*obj = xmalloc(rec->size);
+				if (*obj)
+					touch(*obj, rec->size);
+				else
+					failed += 1;
+				break;
+			case TRACE_CALLOC:
+				*obj = xcalloc(1, rec->size);
+				if (*obj)
+					touch(*obj, rec->size);
+				else
+					failed += 1;
+				break;
+			case TRACE_ALIGNED:
+				*obj = xmalloc_aligned((size_t)1 << rec->shift, rec->size);
+				if (*obj)
+					touch(*obj, rec->size);
+				else
+					failed += 1;
+				break;
+			case TRACE_REALLOC:
+				if (*obj) {
+					void* ptr = xrealloc(*obj, rec->size);
+					if (ptr) {
+						*obj = ptr;
+						touch(ptr, rec->size);
+					}
+					else {
+						failed += 1;
+					}
+				}
+				break;
+			case TRACE_FREE:
+				if (*obj)
+					xfree(*obj);
+				*obj = NULL;
+				break;
+			}
+
+			if (rec->thread >= threads)
+				threads = rec->thread + 1;
+			span = rec->nsec;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		busy += seconds(&t0, &t1);
+		ops += nn;
+	}
+
+	fclose(fh);
+
+	printf("%s: %ld ops (%d threads over %.3f s recorded) in %.3f s, peak RSS %ld KiB (%ld KiB at start)",
+			argv[0], ops, threads, span / 1e9, busy, peak_kb(), start_kb);
+	if (failed)
+		printf(", %ld failed", failed);
+	printf("\n");
+
+	return 0;
+}
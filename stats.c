@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+#include "stats.h"
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static xstats_thread* blocks = NULL;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static __thread xstats_thread* mine = NULL;
+
+// Counters that could not get a block of their own (no memory for one)
+// land here, at the price of sharing it.
+static xstats_thread spare;
+
+static
+void
+bump(long* counter, long nn)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + nn, __ATOMIC_RELAXED);
+}
+
+// The pointer in mine is left alone, so frees made by later thread-exit
+// destructors still count somewhere.
+static
+void
+stats_retire(void* arg)
+{
+	xstats_thread* ts = (xstats_thread*)arg;
+	__atomic_store_n(&ts->alive, 0, __ATOMIC_RELEASE);
+}
+
+static
+void
+stats_key_init()
+{
+	pthread_key_create(&stats_key, stats_retire);
+}
+
+// Blocks come straight from mmap rather than from an allocator that is
+// itself counting.
+static
+xstats_thread*
+stats_register()
+{
+	xstats_thread* ts = NULL;
+
+	pthread_once(&stats_once, stats_key_init);
+
+	pthread_mutex_lock(&stats_lock);
+	for (xstats_thread* tmp = blocks; tmp; tmp = tmp->next) {
+		if (!__atomic_load_n(&tmp->alive, __ATOMIC_ACQUIRE)) {
+			ts = tmp;
+			break;
+		}
+	}
+
+	if (!ts) {
+		size_t bytes = 4096 * ((sizeof(xstats_thread) * 8 + 4095) / 4096);
+		xstats_thread* page = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+
+		if (page != MAP_FAILED) {
+			for (long i = bytes / sizeof(xstats_thread) - 1; i >= 0; i--) {
+				page[i].next = blocks;
+				blocks = &page[i];
+			}
+			ts = blocks;
+		}
+	}
+
+	if (ts)
+		__atomic_store_n(&ts->alive, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&stats_lock);
+
+	if (!ts)
+		return &spare;
+
+	pthread_setspecific(stats_key, ts);
+	mine = ts;
+	return ts;
+}
+
+static
+xstats_thread*
+stats_self()
+{
+	if (mine)
+		return mine;
+	return stats_register();
+}
+
+void
+xstats_alloc(long cls, size_t bytes)
+{
+	xstats_thread* ts = stats_self();
+	bump(&ts->allocs[cls], 1);
+	bump(&ts->bytes_in, bytes);
+}
+
+void
+xstats_free(long cls, size_t bytes)
+{
+	xstats_thread* ts = stats_self();
+	bump(&ts->frees[cls], 1);
+	bump(&ts->bytes_out, bytes);
+}
+
+void
+xstats_resize(size_t old_bytes, size_t new_bytes)
+{
+	xstats_thread* ts = stats_self();
+
+	if (new_bytes > old_bytes)
+		bump(&ts->bytes_in, new_bytes - old_bytes);
+	else
+		bump(&ts->bytes_out, old_bytes - new_bytes);
+}
+
+void
+xstats_lock(pthread_mutex_t* mm)
+{
+	pthread_mutex_lock(mm);
+	bump(&stats_self()->locks, 1);
+}
+
+// Class i serves requests of up to 16 << i bytes, the last one the rest.
+long
+xstats_class(size_t bytes)
+{
+	long cls = 0;
+
+	while (cls < XMALLOC_MAX_CLASSES - 1 && bytes > ((size_t)16 << cls))
+		cls += 1;
+
+	return cls;
+}
+
+void
+xstats_classes(xmalloc_stats_t* st)
+{
+	st->nclasses = XMALLOC_MAX_CLASSES;
+
+	for (long i = 0; i < XMALLOC_MAX_CLASSES - 1; i++)
+		st->classes[i].size = (size_t)16 << i;
+	st->classes[XMALLOC_MAX_CLASSES - 1].size = 0;
+}
+
+static
+void
+stats_add(xmalloc_stats_t* st, xstats_thread* ts, long* in, long* out)
+{
+	for (long i = 0; i < XMALLOC_MAX_CLASSES; i++) {
+		long aa = __atomic_load_n(&ts->allocs[i], __ATOMIC_RELAXED);
+		long ff = __atomic_load_n(&ts->frees[i], __ATOMIC_RELAXED);
+
+		st->classes[i].allocs += aa;
+		st->classes[i].frees += ff;
+		st->allocs += aa;
+		st->frees += ff;
+	}
+
+	*in += __atomic_load_n(&ts->bytes_in, __ATOMIC_RELAXED);
+	*out += __atomic_load_n(&ts->bytes_out, __ATOMIC_RELAXED);
+	st->lock_acquisitions += __atomic_load_n(&ts->locks, __ATOMIC_RELAXED);
+}
+
+// Fill in the counts, in_use and lock_acquisitions of st; class sizes and
+// everything else are up to the backend.
+void
+xstats_sum(xmalloc_stats_t* st)
+{
+	long in = 0;
+	long out = 0;
+
+	st->allocs = 0;
+	st->frees = 0;
+	st->lock_acquisitions = 0;
+	for (long i = 0; i < XMALLOC_MAX_CLASSES; i++) {
+		st->classes[i].allocs = 0;
+		st->classes[i].frees = 0;
+	}
+
+	pthread_mutex_lock(&stats_lock);
+	for (xstats_thread* ts = blocks; ts; ts = ts->next)
+		stats_add(st, ts, &in, &out);
+	pthread_mutex_unlock(&stats_lock);
+
+	stats_add(st, &spare, &in, &out);
+
+	// Another thread's frees can be seen before the allocations they
+	// match, so a snapshot may briefly come out negative.
+	st->in_use = in > out ? in - out : 0;
+}
+
+void
+xmalloc_stats_json(FILE* fh)
+{
+	xmalloc_stats_t st;
+	xmalloc_stats(&st);
+
+	fprintf(fh, "{\"allocs\": %ld, \"frees\": %ld, \"in_use\": %zu, \"cached\": %zu, "
+			"\"mmaps\": %ld, \"munmaps\": %ld, \"lock_acquisitions\": %ld, \"classes\": [",
+			st.allocs, st.frees, st.in_use, st.cached, st.mmaps, st.munmaps, st.lock_acquisitions);
+
+	int first = 1;
+	for (long i = 0; i < st.nclasses; i++) {
+		xmalloc_class_stats* cs = &st.classes[i];
+
+		if (!cs->allocs && !cs->frees)
+			continue;
+
+		fprintf(fh, "%s{\"size\": ", first ? "" : ", ");
+		if (cs->size)
+			fprintf(fh, "%zu", cs->size);
+		else
+			fprintf(fh, "null");
+		fprintf(fh, ", \"allocs\": %ld, \"frees\": %ld}", cs->allocs, cs->frees);
+		first = 0;
+	}
+
+	fprintf(fh, "]}\n");
+}
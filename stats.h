@@ -0,0 +1,38 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <pthread.h>
+
+#include "xmalloc.h"
+
+// Per-thread counters behind xmalloc_stats(), shared by every backend.
+//
+// Each thread bumps a block of its own with plain relaxed stores, and
+// blocks are cache line aligned, so counting never bounces a cache line
+// between threads. Blocks are never freed: when a thread exits its block
+// is handed to the next new thread and keeps accumulating, so summing
+// every block gives process totals.
+//
+// Backends with their own size classes pass the class index; the others
+// use xstats_class(), which bins requests by power of two.
+
+typedef struct xstats_thread {
+	long allocs[XMALLOC_MAX_CLASSES];
+	long frees[XMALLOC_MAX_CLASSES];
+	long bytes_in;        // usable bytes handed out
+	long bytes_out;       // usable bytes given back
+	long locks;           // mutex acquisitions
+	int alive;
+	struct xstats_thread* next;
+} __attribute__((aligned(64))) xstats_thread;
+
+void xstats_alloc(long cls, size_t bytes);
+void xstats_free(long cls, size_t bytes);
+void xstats_resize(size_t old_bytes, size_t new_bytes);
+void xstats_lock(pthread_mutex_t* mm);
+
+long xstats_class(size_t bytes);
+void xstats_classes(xmalloc_stats_t* st);
+void xstats_sum(xmalloc_stats_t* st);
+
+#endif
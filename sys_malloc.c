@@ -1,22 +1,142 @@
 
 #include <stdlib.h>
+#include <malloc.h>
 
 #include "xmalloc.h"
+#include "stats.h"
 
 void*
 xmalloc(size_t bytes)
 {
-    return malloc(bytes);
+    void* ptr = malloc(bytes);
+
+    if (ptr) {
+        size_t usable = malloc_usable_size(ptr);
+        xstats_alloc(xstats_class(usable), usable);
+    }
+
+    return ptr;
 }
 
 void
 xfree(void* ptr)
 {
+    if (ptr) {
+        size_t usable = malloc_usable_size(ptr);
+        xstats_free(xstats_class(usable), usable);
+    }
+
     free(ptr);
 }
 
 void*
 xrealloc(void* prev, size_t bytes)
 {
-    return realloc(prev, bytes);
+    size_t have = prev ? malloc_usable_size(prev) : 0;
+    void* ptr = realloc(prev, bytes);
+
+    if (ptr) {
+        size_t usable = malloc_usable_size(ptr);
+
+        if (prev)
+            xstats_free(xstats_class(have), have);
+        xstats_alloc(xstats_class(usable), usable);
+    }
+
+    return ptr;
+}
+
+void*
+xcalloc(size_t nn, size_t size)
+{
+    void* ptr = calloc(nn, size);
+
+    if (ptr) {
+        size_t usable = malloc_usable_size(ptr);
+        xstats_alloc(xstats_class(usable), usable);
+    }
+
+    return ptr;
+}
+
+int
+xmalloc_trim()
+{
+    return malloc_trim(0);
+}
+
+// The glibc here has no free_sized(), so this is plain free().
+void
+xfree_sized(void* ptr, size_t size)
+{
+#ifdef XMALLOC_DEBUG
+    if (ptr && size > malloc_usable_size(ptr)) {
+        fprintf(stderr, "xfree_sized: %p is not a block of %zu bytes\n", ptr, size);
+        abort();
+    }
+#endif
+
+    xfree(ptr);
+}
+
+// glibc has no batch entry points, so these just loop.
+size_t
+xmalloc_batch(size_t bytes, size_t nn, void** out)
+{
+    size_t ii;
+
+    for (ii = 0; ii < nn; ii++) {
+        if (!(out[ii] = xmalloc(bytes)))
+            break;
+    }
+
+    return ii;
+}
+
+void
+xfree_batch(void** ptrs, size_t nn)
+{
+    for (size_t ii = 0; ii < nn; ii++)
+        xfree(ptrs[ii]);
+}
+
+void*
+xmalloc_aligned(size_t align, size_t bytes)
+{
+    void* ptr = NULL;
+
+    if (align & (align - 1))
+        return NULL;
+
+    if (align < sizeof(void*))
+        align = sizeof(void*);
+
+    if (posix_memalign(&ptr, align, bytes))
+        return NULL;
+
+    size_t usable = malloc_usable_size(ptr);
+    xstats_alloc(xstats_class(usable), usable);
+    return ptr;
+}
+
+size_t
+xmalloc_usable_size(void* ptr)
+{
+    return malloc_usable_size(ptr);
+}
+
+// glibc does its own locking and mapping out of sight, so only the
+// counts made here and what mallinfo2() knows are available.
+void
+xmalloc_stats(xmalloc_stats_t* st)
+{
+    struct mallinfo2 mi = mallinfo2();
+
+    xstats_sum(st);
+    xstats_classes(st);
+
+    st->cached = mi.fordblks;
+    st->mmaps = -1;
+    st->munmaps = -1;
+    st->lock_acquisitions = -1;
 }
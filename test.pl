@@ -4,7 +4,7 @@ use warnings FATAL => 'all';
 use POSIX ":sys_wait_h";
 
 use Time::HiRes qw(time);
-use Test::Simple tests => 14;
+use Test::Simple tests => 16;
 
 sub crc_check {
     my ($file, $expect) = @_;
@@ -47,6 +47,12 @@ ok($hw7_l =~ /at 97: 118 steps/, "list-hwx 100");
 my $hw7_v = run_prog("collatz-ivec-hwx", 100);
 ok($hw7_v =~ /at 97: 118 steps/, "ivec-hwx 100");
 
+$hw7_l = run_prog("collatz-list-hwx", 10000);
+ok($hw7_l =~ /at 6171: 261 steps/, "list-hwx 10k");
+
+$hw7_v = run_prog("collatz-ivec-hwx", 10000);
+ok($hw7_v =~ /at 6171: 261 steps/, "ivec-hwx 10k");
+
 my $par_v = run_prog("collatz-ivec-opt", 1000);
 my $pv_ok = $par_v =~ /at 871: 178 steps/;
 ok($pv_ok, "ivec-par 1k");
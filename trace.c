@@ -0,0 +1,436 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+#include "xmalloc.h"
+#include "trace.h"
+
+// Recording wrapper around a backend. The backend is compiled with
+// -Dxmalloc=real_xmalloc and so on for each entry point, and
+// this file provides the public names. With XMALLOC_TRACE=path every
+// successful call is appended to path; without it calls pass straight
+// through.
+//
+// Everything happens under one lock so the order in the file is an order
+// the calls could really have happened in. The ID table and write buffer
+// come from mmap and static storage, never from the allocator being
+// traced.
+
+void* real_xmalloc(size_t bytes);
+void  real_xfree(void* ptr);
+void* real_xrealloc(void* prev, size_t bytes);
+void* real_xmalloc_aligned(size_t align, size_t bytes);
+void* real_xcalloc(size_t nn, size_t size);
+size_t real_xmalloc_batch(size_t bytes, size_t nn, void** out);
+void real_xfree_batch(void** ptrs, size_t nn);
+void real_xfree_sized(void* ptr, size_t size);
+
+typedef struct slot {
+	void* ptr;            // NULL if empty, TOMB if deleted
+	uint32_t id;
+} slot;
+
+#define TOMB ((void*)1)
+#define BUF_RECS 4096
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int trace_fd = -2;         // -2 until configured, -1 if off
+static struct timespec trace_start;
+static trace_rec buf[BUF_RECS];
+static long buf_used = 0;
+
+static slot* table = NULL;        // open addressing, pointer to ID
+static size_t table_cap = 0;
+static size_t table_used = 0;     // live entries plus tombstones
+
+static uint32_t* free_ids = NULL; // recycled IDs, a stack
+static size_t free_ids_cap = 0;
+static size_t free_ids_len = 0;
+static uint32_t next_id = 0;
+
+static uint16_t threads = 0;
+static __thread int thread_no = 0;    // 0 until this thread first records
+
+static
+void
+trace_flush()
+{
+	size_t bytes = buf_used * sizeof(trace_rec);
+	char* ptr = (char*)buf;
+
+	while (bytes > 0) {
+		ssize_t nn = write(trace_fd, ptr, bytes);
+		if (nn < 0) {
+			perror("xmalloc trace: write() failed");
+			break;
+		}
+		ptr += nn;
+		bytes -= nn;
+	}
+
+	buf_used = 0;
+}
+
+static
+void
+trace_close()
+{
+	pthread_mutex_lock(&trace_lock);
+	if (trace_fd >= 0) {
+		trace_flush();
+		close(trace_fd);
+		trace_fd = -1;
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+// Must hold trace_lock.
+static
+void
+trace_open()
+{
+	char* path = getenv("XMALLOC_TRACE");
+	trace_head head;
+
+	trace_fd = -1;
+	if (!path)
+		return;
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("xmalloc trace: open() failed");
+		return;
+	}
+
+	memcpy(head.magic, TRACE_MAGIC, 4);
+	head.rec_size = sizeof(trace_rec);
+	if (write(fd, &head, sizeof(head)) != sizeof(head)) {
+		perror("xmalloc trace: write() failed");
+		close(fd);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &trace_start);
+	trace_fd = fd;
+	atexit(trace_close);
+}
+
+static
+void*
+map_array(size_t bytes)
+{
+	void* ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+static
+size_t
+table_hash(void* ptr)
+{
+	uint64_t hh = (uint64_t)ptr * 0x9e3779b97f4a7c15ull;
+	return hh >> 17;
+}
+
+static
+slot*
+table_find(void* ptr)
+{
+	if (!table)
+		return NULL;
+
+	for (size_t ii = table_hash(ptr) & (table_cap - 1); table[ii].ptr; ii = (ii + 1) & (table_cap - 1)) {
+		if (table[ii].ptr == ptr)
+			return &table[ii];
+	}
+
+	return NULL;
+}
+
+static
+void table_put(void* ptr, uint32_t id);
+
+// Rebuild at twice the live count, dropping tombstones.
+static
+int
+table_grow()
+{
+	slot* old = table;
+	size_t old_cap = table_cap;
+	size_t cap = 1024;
+
+	while (cap < 4 * (table_used + 1))
+		cap *= 2;
+
+	slot* tmp = map_array(cap * sizeof(slot));
+	if (!tmp)
+		return 0;
+
+	table = tmp;
+	table_cap = cap;
+	table_used = 0;
+
+	for (size_t ii = 0; ii < old_cap; ii++) {
+		if (old[ii].ptr && old[ii].ptr != TOMB)
+			table_put(old[ii].ptr, old[ii].id);
+	}
+
+	if (old)
+		munmap(old, old_cap * sizeof(slot));
+	return 1;
+}
+
+static
+void
+table_put(void* ptr, uint32_t id)
+{
+	if (2 * (table_used + 1) > table_cap && !table_grow())
+		return;
+
+	size_t ii = table_hash(ptr) & (table_cap - 1);
+	while (table[ii].ptr && table[ii].ptr != TOMB)
+		ii = (ii + 1) & (table_cap - 1);
+
+	if (!table[ii].ptr)
+		table_used += 1;
+	table[ii].ptr = ptr;
+	table[ii].id = id;
+}
+
+static
+uint32_t
+id_take()
+{
+	if (free_ids_len)
+		return free_ids[--free_ids_len];
+	return next_id++;
+}
+
+static
+void
+id_give(uint32_t id)
+{
+	if (free_ids_len == free_ids_cap) {
+		size_t cap = free_ids_cap ? 2 * free_ids_cap : 1024;
+		uint32_t* tmp = map_array(cap * sizeof(uint32_t));
+		if (!tmp)
+			return;
+
+		if (free_ids) {
+			memcpy(tmp, free_ids, free_ids_len * sizeof(uint32_t));
+			munmap(free_ids, free_ids_cap * sizeof(uint32_t));
+		}
+		free_ids = tmp;
+		free_ids_cap = cap;
+	}
+
+	free_ids[free_ids_len++] = id;
+}
+
+// Must hold trace_lock.
+static
+void
+trace_put(int op, uint32_t id, size_t size, int shift)
+{
+	struct timespec now;
+	trace_rec* rec = &buf[buf_used++];
+
+	if (!thread_no)
+		thread_no = ++threads;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	rec->op = op;
+	rec->shift = shift;
+	rec->thread = thread_no - 1;
+	rec->id = id;
+	rec->size = size;
+	rec->nsec = (now.tv_sec - trace_start.tv_sec) * 1000000000ull + now.tv_nsec - trace_start.tv_nsec;
+
+	if (buf_used == BUF_RECS)
+		trace_flush();
+}
+
+// Returns with trace_lock held if tracing is on.
+static
+int
+trace_begin()
+{
+	if (__atomic_load_n(&trace_fd, __ATOMIC_ACQUIRE) == -1)
+		return 0;
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_fd == -2)
+		trace_open();
+
+	if (trace_fd < 0) {
+		pthread_mutex_unlock(&trace_lock);
+		return 0;
+	}
+
+	return 1;
+}
+
+void*
+xmalloc(size_t bytes)
+{
+	if (!trace_begin())
+		return real_xmalloc(bytes);
+
+	void* ptr = real_xmalloc(bytes);
+	if (ptr) {
+		uint32_t id = id_take();
+		table_put(ptr, id);
+		trace_put(TRACE_MALLOC, id, bytes, 0);
+	}
+
+	pthread_mutex_unlock(&trace_lock);
+	return ptr;
+}
+
+// Recorded with the total size; replay only needs the bytes.
+void*
+xcalloc(size_t nn, size_t size)
+{
+	if (!trace_begin())
+		return real_xcalloc(nn, size);
+
+	void* ptr = real_xcalloc(nn, size);
+	if (ptr) {
+		uint32_t id = id_take();
+		table_put(ptr, id);
+		trace_put(TRACE_CALLOC, id, nn * size, 0);
+	}
+
+	pthread_mutex_unlock(&trace_lock);
+	return ptr;
+}
+
+void*
+xmalloc_aligned(size_t align, size_t bytes)
+{
+	if (!trace_begin())
+		return real_xmalloc_aligned(align, bytes);
+
+	void* ptr = real_xmalloc_aligned(align, bytes);
+	if (ptr) {
+		uint32_t id = id_take();
+		table_put(ptr, id);
+		trace_put(TRACE_ALIGNED, id, bytes, __builtin_ctzl(align));
+	}
+
+	pthread_mutex_unlock(&trace_lock);
+	return ptr;
+}
+
+void
+xfree(void* ptr)
+{
+	if (!ptr || !trace_begin()) {
+		real_xfree(ptr);
+		return;
+	}
+
+	slot* ss = table_find(ptr);
+	if (ss) {
+		trace_put(TRACE_FREE, ss->id, 0, 0);
+		id_give(ss->id);
+		ss->ptr = TOMB;
+	}
+
+	real_xfree(ptr);
+	pthread_mutex_unlock(&trace_lock);
+}
+
+// Batches are recorded as one record per block, so replay turns them
+// back into single calls.
+size_t
+xmalloc_batch(size_t bytes, size_t nn, void** out)
+{
+	if (!trace_begin())
+		return real_xmalloc_batch(bytes, nn, out);
+
+	size_t got = real_xmalloc_batch(bytes, nn, out);
+	for (size_t ii = 0; ii < got; ii++) {
+		uint32_t id = id_take();
+		table_put(out[ii], id);
+		trace_put(TRACE_MALLOC, id, bytes, 0);
+	}
+
+	pthread_mutex_unlock(&trace_lock);
+	return got;
+}
+
+void
+xfree_batch(void** ptrs, size_t nn)
+{
+	if (!trace_begin()) {
+		real_xfree_batch(ptrs, nn);
+		return;
+	}
+
+	for (size_t ii = 0; ii < nn; ii++) {
+		slot* ss = ptrs[ii] ? table_find(ptrs[ii]) : NULL;
+		if (ss) {
+			trace_put(TRACE_FREE, ss->id, 0, 0);
+			id_give(ss->id);
+			ss->ptr = TOMB;
+		}
+	}
+
+	real_xfree_batch(ptrs, nn);
+	pthread_mutex_unlock(&trace_lock);
+}
+
+void
+xfree_sized(void* ptr, size_t size)
+{
+	if (!ptr || !trace_begin()) {
+		real_xfree_sized(ptr, size);
+		return;
+	}
+
+	slot* ss = table_find(ptr);
+	if (ss) {
+		trace_put(TRACE_FREE, ss->id, 0, 0);
+		id_give(ss->id);
+		ss->ptr = TOMB;
+	}
+
+	real_xfree_sized(ptr, size);
+	pthread_mutex_unlock(&trace_lock);
+}
+
+void*
+xrealloc(void* prev, size_t bytes)
+{
+	if (!trace_begin())
+		return real_xrealloc(prev, bytes);
+
+	slot* ss = prev ? table_find(prev) : NULL;
+	void* ptr = real_xrealloc(prev, bytes);
+
+	if (ptr) {
+		uint32_t id;
+
+		if (ss) {
+			id = ss->id;
+			ss->ptr = TOMB;
+			trace_put(TRACE_REALLOC, id, bytes, 0);
+		}
+		else {
+			id = id_take();
+			trace_put(TRACE_MALLOC, id, bytes, 0);
+		}
+		table_put(ptr, id);
+	}
+
+	pthread_mutex_unlock(&trace_lock);
+	return ptr;
+}
@@ -0,0 +1,37 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// On-disk format of an allocation trace: a trace_head, then one trace_rec
+// per call in the order the calls took effect.
+//
+// Objects are named by ID rather than address. An ID is handed out by
+// xmalloc, follows its object through every xrealloc and is recycled once
+// the object is freed, so IDs stay below the peak number of live objects.
+
+#define TRACE_MAGIC "XTR1"
+
+enum {
+	TRACE_MALLOC = 'm',
+	TRACE_FREE = 'f',
+	TRACE_REALLOC = 'r',
+	TRACE_ALIGNED = 'a',
+	TRACE_CALLOC = 'c',
+};
+
+typedef struct trace_head {
+	char magic[4];
+	uint32_t rec_size;    // sizeof(trace_rec) when written
+} trace_head;
+
+typedef struct trace_rec {
+	uint8_t op;
+	uint8_t shift;        // log2 of the alignment for TRACE_ALIGNED
+	uint16_t thread;      // order in which threads first allocated
+	uint32_t id;
+	uint64_t size;        // bytes asked for, 0 for frees
+	uint64_t nsec;        // since the trace was opened
+} trace_rec;
+
+#endif
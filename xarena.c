@@ -0,0 +1,130 @@
+#include <stdint.h>
+
+#include "xmalloc.h"
+#include "pages.h"
+
+// Chunks come from pages_alloc(), starting at XARENA_CHUNK and doubling
+// up to XARENA_CHUNK_MAX; a block bigger than that gets a chunk of its
+// own. The arena itself lives at the start of its first chunk.
+#define XARENA_PAGE 4096
+#define XARENA_CHUNK ((size_t)64 * 1024)
+#define XARENA_CHUNK_MAX ((size_t)4 * 1024 * 1024)
+#define XARENA_ALIGN 16
+
+typedef struct achunk {
+	struct achunk* next;
+	size_t size;          // bytes, this header included
+} achunk;
+
+struct xarena {
+	achunk* head;         // first chunk, which holds this struct
+	achunk* cur;          // chunk being bumped through
+	char* next;           // first free byte in cur
+	char* end;
+};
+
+static
+size_t
+round_up(size_t xx, size_t align)
+{
+	return (xx + align - 1) & ~(align - 1);
+}
+
+static
+void
+chunk_enter(xarena_t* ar, achunk* ch, size_t skip)
+{
+	ar->cur = ch;
+	ar->next = (char*)ch + skip;
+	ar->end = (char*)ch + ch->size;
+}
+
+xarena_t*
+xarena_create()
+{
+	achunk* ch = pages_alloc(XARENA_CHUNK, XARENA_PAGE);
+	if (!ch)
+		return NULL;
+
+	ch->next = NULL;
+	ch->size = XARENA_CHUNK;
+
+	xarena_t* ar = (xarena_t*)(ch + 1);
+	ar->head = ch;
+	chunk_enter(ar, ch, round_up(sizeof(achunk) + sizeof(xarena_t), XARENA_ALIGN));
+	return ar;
+}
+
+// Move on to the next chunk with room for bytes, reusing the ones kept
+// by xarena_reset() before taking a new one. Chunks skipped for being
+// too small sit idle until the next reset.
+static
+void*
+arena_grow(xarena_t* ar, size_t bytes)
+{
+	size_t skip = round_up(sizeof(achunk), XARENA_ALIGN);
+	achunk* ch;
+
+	for (ch = ar->cur->next; ch; ch = ch->next) {
+		if (ch->size - skip >= bytes)
+			break;
+	}
+
+	if (!ch) {
+		size_t size = ar->cur->size * 2;
+		if (size > XARENA_CHUNK_MAX)
+			size = XARENA_CHUNK_MAX;
+		if (size < skip + bytes)
+			size = round_up(skip + bytes, XARENA_PAGE);
+
+		ch = pages_alloc(size, XARENA_PAGE);
+		if (!ch)
+			return NULL;
+
+		ch->size = size;
+		ch->next = ar->cur->next;
+		ar->cur->next = ch;
+	}
+
+	chunk_enter(ar, ch, skip);
+	void* ptr = ar->next;
+	ar->next += bytes;
+	return ptr;
+}
+
+void*
+xarena_alloc(xarena_t* ar, size_t bytes)
+{
+	if (bytes > PTRDIFF_MAX)
+		return NULL;
+
+	bytes = round_up(bytes ? bytes : 1, XARENA_ALIGN);
+
+	if ((size_t)(ar->end - ar->next) >= bytes) {
+		void* ptr = ar->next;
+		ar->next += bytes;
+		return ptr;
+	}
+
+	return arena_grow(ar, bytes);
+}
+
+// Every chunk is kept for reuse, so this is O(1) however much was
+// allocated; only xarena_destroy() gives memory back.
+void
+xarena_reset(xarena_t* ar)
+{
+	chunk_enter(ar, ar->head, round_up(sizeof(achunk) + sizeof(xarena_t), XARENA_ALIGN));
+}
+
+void
+xarena_destroy(xarena_t* ar)
+{
+	achunk* ch = ar->head;
+
+	while (ch) {
+		achunk* next = ch->next;
+		pages_free(ch, ch->size);
+		ch = next;
+	}
+}
@@ -2,12 +2,99 @@
 #define XMALLOC_H
 
 #include <stddef.h>
+#include <stdio.h>
 
 void* xmalloc(size_t bytes);
 void  xfree(void* ptr);
 void* xrealloc(void* prev, size_t bytes);
 
-void dump_flist();
-void dump_buckets();
+// nn * size zeroed bytes, NULL on overflow. Memory fresh from mmap, or
+// never handed out since, is known to be zero and is not cleared again,
+// so a large xcalloc touches no pages until they are used; only recycled
+// memory is cleared.
+void* xcalloc(size_t nn, size_t size);
+
+// xfree() for a block the caller knows the size of: anything from the
+// size it asked for up to xmalloc_usable_size(ptr). Backends that can
+// use the size to skip reading allocator metadata do; building with
+// -DXMALLOC_DEBUG checks the size and aborts if it is wrong. Not for
+// blocks from xmalloc_aligned().
+void xfree_sized(void* ptr, size_t size);
+
+// Allocate nn blocks of bytes each into out[], taking the allocator's
+// lock at most once for the lot. Returns how many were allocated; fewer
+// than nn means memory ran out, and out[] past that is left alone.
+size_t xmalloc_batch(size_t bytes, size_t nn, void** out);
+
+// Free the nn blocks in ptrs[], any of which may be NULL, in one pass.
+void xfree_batch(void** ptrs, size_t nn);
+
+// bytes aligned to align, a power of two; NULL if align is not one. The
+// block is freed and resized like any other.
+void* xmalloc_aligned(size_t align, size_t bytes);
+
+// Give cached free memory back to the OS now instead of waiting for it
+// to decay. Returns 1 if anything was released, 0 if not.
+int xmalloc_trim();
+
+// A region for blocks that all die together. xarena_alloc() bumps a
+// pointer through chunks of pages from the same page source the
+// backends use, 16-byte aligned; its blocks are never freed one by one.
+// xarena_reset() drops them all at once in O(1), keeping the chunks for
+// reuse, and xarena_destroy() returns the chunks. An arena is for one
+// thread at a time. Both create and alloc return NULL if memory runs out.
+typedef struct xarena xarena_t;
+
+xarena_t* xarena_create();
+void* xarena_alloc(xarena_t* ar, size_t bytes);
+void  xarena_reset(xarena_t* ar);
+void  xarena_destroy(xarena_t* ar);
+
+// A pool of objects of one size and alignment (a power of two up to the
+// page size), for hot fixed-size types: xpool_alloc() pops a free object
+// off a per-thread magazine with no size lookup and xpool_free() pushes
+// it back. If ctor is given it runs once per object, when the object is
+// first carved out, and freed objects keep their state, so callers must
+// leave them as ctor would. Objects may be freed by any thread, only to
+// their own pool. xpool_destroy() returns every object at once; no
+// thread may use the pool after that. NULL on bad alignment or no memory.
+typedef struct xpool xpool_t;
+
+xpool_t* xpool_create(size_t size, size_t align, void (*ctor)(void*));
+void* xpool_alloc(xpool_t* pool);
+void  xpool_free(xpool_t* pool, void* obj);
+void  xpool_destroy(xpool_t* pool);
+
+// Bytes actually available at ptr, at least what was asked for.
+size_t xmalloc_usable_size(void* ptr);
+
+#define XMALLOC_MAX_CLASSES 32
+
+typedef struct xmalloc_class_stats {
+    size_t size;        // largest request the class serves, 0 for "larger"
+    long allocs;
+    long frees;
+} xmalloc_class_stats;
+
+// Counters are -1 where a backend cannot tell.
+typedef struct xmalloc_stats_t {
+    long allocs;
+    long frees;
+    size_t in_use;      // usable bytes handed out and not yet freed
+    size_t cached;      // bytes free inside the allocator, ready for reuse
+    long mmaps;
+    long munmaps;
+    long lock_acquisitions;
+    long nclasses;
+    xmalloc_class_stats classes[XMALLOC_MAX_CLASSES];
+} xmalloc_stats_t;
+
+// Totals over every thread that ever allocated. Each thread counts into
+// its own block, so the totals are a snapshot that may be a few
+// operations behind threads running at the same time.
+void xmalloc_stats(xmalloc_stats_t* st);
+
+// xmalloc_stats() as a single-line JSON object.
+void xmalloc_stats_json(FILE* fh);
 
 #endif
@@ -0,0 +1,321 @@
+#include <stdint.h>
+#include <pthread.h>
+
+#include "xmalloc.h"
+#include "pages.h"
+#include "stats.h"
+
+// Objects are carved from slabs of pages_alloc() pages; the pool itself
+// lives at the start of its first slab. A free object holds the link to
+// the next one at link_off: its first word, or the word past its end if
+// the pool has a constructor, so the constructed state survives.
+//
+// Each thread keeps a magazine per pool, a list of up to XPOOL_MAG free
+// objects it allocates from and frees to without locking. A magazine
+// refills from, and spills half of itself to, the pool's shared list.
+// Only the first XPOOL_MAX pools alive at once get magazines; the rest
+// take the pool lock on every call.
+#define XPOOL_PAGE 4096
+#define XPOOL_SLAB ((size_t)64 * 1024)
+#define XPOOL_MAG 64
+#define XPOOL_MAX 64
+
+typedef struct pslab {
+	struct pslab* next;
+	size_t size;
+} pslab;
+
+struct xpool {
+	pthread_mutex_t lock;
+	size_t size;          // as asked for
+	size_t slot;          // bytes per object, link included
+	size_t align;
+	size_t link_off;
+	void (*ctor)(void*);
+	long id;              // magazine index, -1 for none
+	long gen;             // tells this pool from an earlier one with its id
+	void* free;           // shared free list
+	pslab* slabs;
+	char* next;           // uncarved part of the newest slab
+	char* end;
+};
+
+typedef struct xmag {
+	long gen;
+	long count;
+	void* head;
+} xmag;
+
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static xpool_t* pools[XPOOL_MAX];
+static long pools_gen = 0;
+
+static __thread xmag mags[XPOOL_MAX];
+static __thread int mags_registered = 0;
+static pthread_key_t mags_key;
+static pthread_once_t mags_once = PTHREAD_ONCE_INIT;
+
+static
+size_t
+round_up(size_t xx, size_t align)
+{
+	return (xx + align - 1) & ~(align - 1);
+}
+
+static inline
+void**
+link_of(xpool_t* pool, void* obj)
+{
+	return (void**)((char*)obj + pool->link_off);
+}
+
+// Hand nn objects from the list at head back to the shared list. The
+// caller counts them.
+static
+void
+pool_give(xpool_t* pool, void* head, long nn)
+{
+	void* tail = head;
+	for (long ii = 1; ii < nn; ii++)
+		tail = *link_of(pool, tail);
+
+	xstats_lock(&pool->lock);
+	*link_of(pool, tail) = pool->free;
+	pool->free = head;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// Runs when a thread exits, giving every magazine back to its pool.
+static
+void
+mags_drain(void* _arg)
+{
+	pthread_mutex_lock(&pools_lock);
+	for (long ii = 0; ii < XPOOL_MAX; ii++) {
+		xmag* mag = &mags[ii];
+		if (mag->count && pools[ii] && pools[ii]->gen == mag->gen)
+			pool_give(pools[ii], mag->head, mag->count);
+		mag->count = 0;
+		mag->head = NULL;
+	}
+	pthread_mutex_unlock(&pools_lock);
+}
+
+static
+void
+mags_key_init()
+{
+	pthread_key_create(&mags_key, mags_drain);
+}
+
+static
+void
+mags_register()
+{
+	pthread_once(&mags_once, mags_key_init);
+	pthread_setspecific(mags_key, mags);
+	mags_registered = 1;
+}
+
+// Carve a slab into the pool's uncarved range. Must hold pool->lock.
+static
+int
+pool_grow(xpool_t* pool)
+{
+	size_t skip = round_up(sizeof(pslab), pool->align);
+	size_t size = round_up(skip + 8 * pool->slot, XPOOL_PAGE);
+	if (size < XPOOL_SLAB)
+		size = XPOOL_SLAB;
+
+	pslab* sb = pages_alloc(size, XPOOL_PAGE);
+	if (!sb)
+		return 0;
+
+	sb->size = size;
+	sb->next = pool->slabs->next;
+	pool->slabs->next = sb;
+	pool->next = (char*)sb + skip;
+	pool->end = (char*)sb + size;
+	return 1;
+}
+
+// Take up to nn objects as a list, constructing any never handed out
+// before. Returns how many were taken. Must hold pool->lock.
+static
+long
+pool_take(xpool_t* pool, long nn, void** head)
+{
+	long got = 0;
+
+	*head = NULL;
+	while (got < nn && pool->free) {
+		void* obj = pool->free;
+		pool->free = *link_of(pool, obj);
+		*link_of(pool, obj) = *head;
+		*head = obj;
+		got++;
+	}
+
+	while (got < nn) {
+		if ((size_t)(pool->end - pool->next) < pool->slot && !pool_grow(pool))
+			break;
+
+		void* obj = pool->next;
+		pool->next += pool->slot;
+		if (pool->ctor)
+			pool->ctor(obj);
+		*link_of(pool, obj) = *head;
+		*head = obj;
+		got++;
+	}
+
+	return got;
+}
+
+xpool_t*
+xpool_create(size_t size, size_t align, void (*ctor)(void*))
+{
+	if (!align || (align & (align - 1)) || align > XPOOL_PAGE || size > PTRDIFF_MAX / 16)
+		return NULL;
+	if (align < sizeof(void*))
+		align = sizeof(void*);
+
+	size_t link_off = ctor ? round_up(size, sizeof(void*)) : 0;
+	size_t slot = round_up(link_off + sizeof(void*) > size ? link_off + sizeof(void*) : size, align);
+	size_t skip = round_up(sizeof(pslab) + sizeof(xpool_t), align);
+	size_t bytes = round_up(skip + 8 * slot, XPOOL_PAGE);
+	if (bytes < XPOOL_SLAB)
+		bytes = XPOOL_SLAB;
+
+	pslab* sb = pages_alloc(bytes, XPOOL_PAGE);
+	if (!sb)
+		return NULL;
+
+	sb->next = NULL;
+	sb->size = bytes;
+
+	xpool_t* pool = (xpool_t*)(sb + 1);
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->size = size;
+	pool->slot = slot;
+	pool->align = align;
+	pool->link_off = link_off;
+	pool->ctor = ctor;
+	pool->free = NULL;
+	pool->slabs = sb;
+	pool->next = (char*)sb + skip;
+	pool->end = (char*)sb + bytes;
+	pool->id = -1;
+
+	pthread_mutex_lock(&pools_lock);
+	pool->gen = ++pools_gen;
+	for (long ii = 0; ii < XPOOL_MAX; ii++) {
+		if (!pools[ii]) {
+			pools[ii] = pool;
+			pool->id = ii;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pools_lock);
+
+	return pool;
+}
+
+void*
+xpool_alloc(xpool_t* pool)
+{
+	void* obj;
+
+	if (pool->id < 0) {
+		xstats_lock(&pool->lock);
+		long got = pool_take(pool, 1, &obj);
+		pthread_mutex_unlock(&pool->lock);
+		return got ? obj : NULL;
+	}
+
+	xmag* mag = &mags[pool->id];
+	if (mag->gen != pool->gen || !mag->count) {
+		if (!mags_registered)
+			mags_register();
+
+		// What is left from a destroyed pool with this id is not ours.
+		if (mag->gen != pool->gen) {
+			mag->gen = pool->gen;
+			mag->head = NULL;
+			mag->count = 0;
+		}
+
+		xstats_lock(&pool->lock);
+		mag->count = pool_take(pool, XPOOL_MAG / 2, &mag->head);
+		pthread_mutex_unlock(&pool->lock);
+
+		if (!mag->count)
+			return NULL;
+	}
+
+	obj = mag->head;
+	mag->head = *link_of(pool, obj);
+	mag->count--;
+	return obj;
+}
+
+void
+xpool_free(xpool_t* pool, void* obj)
+{
+	if (!obj)
+		return;
+
+	if (pool->id < 0) {
+		*link_of(pool, obj) = NULL;
+		pool_give(pool, obj, 1);
+		return;
+	}
+
+	xmag* mag = &mags[pool->id];
+	if (mag->gen != pool->gen) {
+		if (!mags_registered)
+			mags_register();
+		mag->gen = pool->gen;
+		mag->head = NULL;
+		mag->count = 0;
+	}
+
+	*link_of(pool, obj) = mag->head;
+	mag->head = obj;
+	mag->count++;
+
+	// Spill the older half, keeping the objects this thread freed last.
+	if (mag->count == XPOOL_MAG) {
+		void** cut = &mag->head;
+		for (long ii = 0; ii < XPOOL_MAG / 2; ii++)
+			cut = link_of(pool, *cut);
+
+		void* spill = *cut;
+		*cut = NULL;
+		pool_give(pool, spill, XPOOL_MAG / 2);
+		mag->count = XPOOL_MAG / 2;
+	}
+}
+
+void
+xpool_destroy(xpool_t* pool)
+{
+	pthread_mutex_lock(&pools_lock);
+	if (pool->id >= 0)
+		pools[pool->id] = NULL;
+	pthread_mutex_unlock(&pools_lock);
+
+	if (pool->id >= 0 && mags[pool->id].gen == pool->gen) {
+		mags[pool->id].head = NULL;
+		mags[pool->id].count = 0;
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+
+	pslab* sb = pool->slabs;
+	while (sb) {
+		pslab* next = sb->next;
+		pages_free(sb, sb->size);
+		sb = next;
+	}
+}
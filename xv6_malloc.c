@@ -2,8 +2,12 @@
 #include <sys/mman.h>
 #include <pthread.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
 
 #include "xmalloc.h"
+#include "pages.h"
+#include "stats.h"
 
 // Memory allocator by Kernighan and Ritchie,
 // The C programming Language, 2nd ed.  Section 8.7.
@@ -30,6 +34,7 @@ typedef union header Header;
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 static Header base;
 static Header *freep;
+static long mmaps;
 
 static
 void
@@ -57,7 +62,10 @@ xfree_helper(void *ap)
 void
 xfree(void* ap)
 {
-  pthread_mutex_lock(&lock);
+  size_t usable = xmalloc_usable_size(ap);
+
+  xstats_free(xstats_class(usable), usable);
+  xstats_lock(&lock);
   xfree_helper(ap);
   pthread_mutex_unlock(&lock);
 }
@@ -75,20 +83,20 @@ morecore(size_t nu)
            MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
   if(p == (char*)-1)
     return 0;
+  mmaps++;
   hp = (Header*)p;
   hp->s.size = nu;
   xfree_helper((void*)(hp + 1));
   return freep;
 }
 
+// Must hold lock.
+static
 void*
-xmalloc(size_t nbytes)
+xmalloc_helper(unsigned int nunits)
 {
   Header *p, *prevp;
-  unsigned int nunits;
 
-  pthread_mutex_lock(&lock);
-  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
   if((prevp = freep) == 0){
     base.s.ptr = freep = prevp = &base;
     base.s.size = 0;
@@ -103,21 +111,198 @@ xmalloc(size_t nbytes)
         p->s.size = nunits;
       }
       freep = prevp;
-      pthread_mutex_unlock(&lock);
       return (void*)(p + 1);
     }
-    if(p == freep) {
-      if((p = morecore(nunits)) == 0) {
-        pthread_mutex_unlock(&lock);
+    if(p == freep)
+      if((p = morecore(nunits)) == 0)
         return 0;
-      }
-    }
   }
 }
 
+void*
+xmalloc(size_t nbytes)
+{
+  void *ptr;
+  unsigned int nunits;
+
+  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
+  xstats_lock(&lock);
+  ptr = xmalloc_helper(nunits);
+  pthread_mutex_unlock(&lock);
+  if(ptr)
+    xstats_alloc(xstats_class((nunits - 1) * sizeof(Header)), (nunits - 1) * sizeof(Header));
+  return ptr;
+}
+
+// The free list lives in its blocks' headers, so nothing can be unmapped,
+// but the whole pages behind each header can be dropped.
+int
+xmalloc_trim()
+{
+  Header *p;
+  int done = 0;
+
+  xstats_lock(&lock);
+  if((p = freep) != 0){
+    do {
+      if(p->s.size > 1 && pages_discard(p + 1, (p->s.size - 1) * sizeof(Header)))
+        done = 1;
+      p = p->s.ptr;
+    } while(p != freep);
+  }
+  pthread_mutex_unlock(&lock);
+  return done;
+}
+
+// Coalescing needs the header anyway, so the size is only checked.
+void
+xfree_sized(void *ap, size_t size)
+{
+#ifdef XMALLOC_DEBUG
+  if(size > xmalloc_usable_size(ap)){
+    fprintf(stderr, "xfree_sized: %p is not a block of %zu bytes\n", ap, size);
+    abort();
+  }
+#endif
+  xfree(ap);
+}
+
+size_t
+xmalloc_batch(size_t nbytes, size_t nn, void **out)
+{
+  size_t i, j;
+  unsigned int nunits;
+
+  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
+  xstats_lock(&lock);
+  for(i = 0; i < nn; i++)
+    if((out[i] = xmalloc_helper(nunits)) == 0)
+      break;
+  pthread_mutex_unlock(&lock);
+  for(j = 0; j < i; j++)
+    xstats_alloc(xstats_class((nunits - 1) * sizeof(Header)), (nunits - 1) * sizeof(Header));
+  return i;
+}
+
+void
+xfree_batch(void **ptrs, size_t nn)
+{
+  size_t i, usable;
+
+  for(i = 0; i < nn; i++){
+    if(ptrs[i] == 0)
+      continue;
+    usable = xmalloc_usable_size(ptrs[i]);
+    xstats_free(xstats_class(usable), usable);
+  }
+  xstats_lock(&lock);
+  for(i = 0; i < nn; i++)
+    if(ptrs[i])
+      xfree_helper(ptrs[i]);
+  pthread_mutex_unlock(&lock);
+}
+
+// Blocks come off a shared free list and are always cleared.
+void*
+xcalloc(size_t nn, size_t size)
+{
+  void *ptr;
+
+  if(size && nn > SIZE_MAX / size)
+    return 0;
+  if((ptr = xmalloc(nn * size)) != 0)
+    memset(ptr, 0, nn * size);
+  return ptr;
+}
+
+// Take a block with room to slide forward to an aligned payload, then
+// give back the units in front of it and any spare units behind. All of
+// it happens under one lock and only the block kept is counted, so the
+// stats see it in its own size class.
+void*
+xmalloc_aligned(size_t align, size_t nbytes)
+{
+  Header *p, *q, *r;
+  unsigned int nunits;
+
+  if(align & (align - 1))
+    return 0;
+  if(align <= sizeof(Header))
+    return xmalloc(nbytes);
+
+  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
+  xstats_lock(&lock);
+  if((p = xmalloc_helper(nunits + (align + sizeof(Header) - 1)/sizeof(Header))) == 0){
+    pthread_mutex_unlock(&lock);
+    return 0;
+  }
+  p = p - 1;
+
+  if(((uintptr_t)(p + 1) & (align - 1)) == 0)
+    q = p;
+  else
+    q = (Header*)(((uintptr_t)(p + 2) + align - 1) & ~(uintptr_t)(align - 1)) - 1;
+  r = 0;
+
+  if(q != p){
+    q->s.size = p->s.size - (q - p);
+    p->s.size = q - p;
+  }
+  if(q->s.size > nunits + 1){
+    r = q + nunits;
+    r->s.size = q->s.size - nunits;
+    q->s.size = nunits;
+  }
+  if(q != p)
+    xfree_helper((void*)(p + 1));
+  if(r)
+    xfree_helper((void*)(r + 1));
+  pthread_mutex_unlock(&lock);
+
+  xstats_alloc(xstats_class((q->s.size - 1) * sizeof(Header)), (q->s.size - 1) * sizeof(Header));
+  return (void*)(q + 1);
+}
+
+size_t
+xmalloc_usable_size(void* ap)
+{
+  Header *bp = (Header*)ap - 1;
+  return (bp->s.size - 1) * sizeof(Header);
+}
+
 void*
 xrealloc(void* prev, size_t nn)
 {
-  // TODO: implement a working realloc
-  return prev + nn;
+  void *ptr;
+  size_t have = xmalloc_usable_size(prev);
+
+  if(nn <= have)
+    return prev;
+  if((ptr = xmalloc(nn)) == 0)
+    return 0;
+  memcpy(ptr, prev, have);
+  xfree(prev);
+  return ptr;
+}
+
+void
+xmalloc_stats(xmalloc_stats_t* st)
+{
+  Header *p;
+
+  xstats_sum(st);
+  xstats_classes(st);
+
+  st->cached = 0;
+  xstats_lock(&lock);
+  if(freep){
+    p = freep;
+    do {
+      st->cached += p->s.size * sizeof(Header);
+      p = p->s.ptr;
+    } while(p != freep);
+  }
+  st->mmaps = mmaps;
+  pthread_mutex_unlock(&lock);
+  st->munmaps = 0;
 }